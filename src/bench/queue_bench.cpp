@@ -0,0 +1,154 @@
+// Throughput of the queues in queue.h under contention: P producers push
+// ITEMS integers in total through a bounded queue to one consumer, as the
+// io threads do into a per-app query queue. Then the 1:1 channels: SPSC
+// throughput with the consumer taking batches (pop_n, across the ring's
+// wraparound, checking the order), and the latency of waking a parked
+// consumer. Run with the item count as the only (optional) argument.
+
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "queue.h"
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t CAPACITY = 4096;
+
+// Items per second, 0 if the consumer saw a wrong sum.
+template <typename Queue>
+double run_mpsc(size_t producers, uint64_t items)
+{
+  Queue queue(CAPACITY, OverflowPolicy::BLOCK);
+  uint64_t per_producer = items / producers;
+  uint64_t total = per_producer * producers;
+  uint64_t sum = 0;
+  auto start = Clock::now();
+  std::thread consumer([&]()
+                       {
+    for (uint64_t i = 0; i < total; i++)
+    {
+      sum += queue.pop();
+    } });
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; p++)
+  {
+    threads.emplace_back([&]()
+                         {
+      for (uint64_t i = 1; i <= per_producer; i++)
+      {
+        queue.push(i);
+      } });
+  }
+  for (auto &thread : threads)
+  {
+    thread.join();
+  }
+  consumer.join();
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  return sum == producers * (per_producer * (per_producer + 1) / 2) ? total / seconds : 0;
+}
+
+// HybridSPSCQueue has no overflow policy, it always blocks.
+template <typename Queue>
+std::unique_ptr<Queue> make_queue(size_t capacity)
+{
+  if constexpr (std::is_constructible_v<Queue, size_t, OverflowPolicy>)
+    return std::make_unique<Queue>(capacity, OverflowPolicy::BLOCK);
+  else
+    return std::make_unique<Queue>(capacity);
+}
+
+// Items per second, 0 if an item came out of order. Batches of BATCH do
+// not divide the capacity, so pop_n keeps straddling the end of the ring.
+template <typename Queue>
+double run_spsc(uint64_t items)
+{
+  static constexpr size_t BATCH = 100;
+  auto queue = make_queue<Queue>(CAPACITY);
+  uint64_t total = items - items % BATCH;
+  bool ordered = true;
+  auto start = Clock::now();
+  std::thread consumer([&]()
+                       {
+    std::vector<uint64_t> batch;
+    batch.reserve(BATCH);
+    for (uint64_t next = 1; next <= total;)
+    {
+      batch.clear();
+      queue->pop_n(batch, BATCH);
+      for (uint64_t item : batch)
+      {
+        ordered &= item == next++;
+      }
+    } });
+  for (uint64_t i = 1; i <= total; i++)
+  {
+    queue->push(i);
+  }
+  consumer.join();
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  return ordered ? total / seconds : 0;
+}
+
+// Median microseconds from a push to the return of the parked consumer's
+// pop(), the producer pausing between pushes so the consumer parks.
+template <typename Queue>
+double wakeup_latency_us(size_t samples)
+{
+  auto queue = make_queue<Queue>(CAPACITY);
+  std::vector<double> latencies;
+  latencies.reserve(samples);
+  std::thread consumer([&]()
+                       {
+    for (size_t i = 0; i < samples; i++)
+    {
+      int64_t sent = queue->pop();
+      int64_t now = Clock::now().time_since_epoch().count();
+      latencies.push_back((now - sent) / 1000.0);
+    } });
+  for (size_t i = 0; i < samples; i++)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    queue->push(static_cast<int64_t>(Clock::now().time_since_epoch().count()));
+  }
+  consumer.join();
+  std::nth_element(latencies.begin(), latencies.begin() + samples / 2, latencies.end());
+  return latencies[samples / 2];
+}
+
+int main(int argc, char **argv)
+{
+  uint64_t items = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4000000;
+
+  std::printf("%-10s %16s %16s %8s\n", "producers", "BlockingQueue/s", "MPMCQueue/s", "ratio");
+  for (size_t producers : {1, 4, 16})
+  {
+    double blocking = run_mpsc<BlockingQueue<uint64_t>>(producers, items);
+    double mpmc = run_mpsc<MPMCQueue<uint64_t>>(producers, items);
+    std::printf("%-10zu %16.0f %16.0f %8.2f\n", producers, blocking, mpmc, blocking > 0 ? mpmc / blocking : 0);
+    if (blocking == 0 || mpmc == 0)
+    {
+      std::fprintf(stderr, "Lost or duplicated items with %zu producers\n", producers);
+      return 1;
+    }
+  }
+
+  std::printf("\n%-10s %16s %16s %8s\n", "1:1", "BlockingQueue", "HybridSPSCQueue", "ratio");
+  double blocking = run_spsc<BlockingQueue<uint64_t>>(items);
+  double spsc = run_spsc<HybridSPSCQueue<uint64_t>>(items);
+  std::printf("%-10s %16.0f %16.0f %8.2f\n", "items/s", blocking, spsc, blocking > 0 ? spsc / blocking : 0);
+  if (blocking == 0 || spsc == 0)
+  {
+    std::fprintf(stderr, "Items out of order through pop_n\n");
+    return 1;
+  }
+  double blocking_us = wakeup_latency_us<BlockingQueue<int64_t>>(1000);
+  double spsc_us = wakeup_latency_us<HybridSPSCQueue<int64_t>>(1000);
+  std::printf("%-10s %16.1f %16.1f %8.2f\n", "wakeup us", blocking_us, spsc_us, blocking_us > 0 ? spsc_us / blocking_us : 0);
+  return 0;
+}
@@ -8,9 +8,14 @@
 #include <thread>
 #include <fstream>
 #include <optional>
+#include <shared_mutex>
 #include <condition_variable>
 #include "engine.h"
 #include "utils/general.h"
+#include "utils/histogram.h"
+#include "utils/stats.h"
+#include "utils/async.h"
+#include "utils/handles.h"
 #include "utils/datastore.h"
 #include "utils/load_balancing.h"
 #include "networking/port.h"
@@ -31,6 +36,59 @@ enum class Approach
 class Controller : public Engine
 {
 public:
+  // A query waiting to be forwarded, stamped on arrival for the batching
+  // deadline and the queueing-delay stats.
+  struct QueuedQuery
+  {
+    Message message;
+    std::chrono::steady_clock::time_point arrival;
+  };
+
+  // Filled by the io loop, drained by the app's forwarder at query rate:
+  // the lock-free queue (BlockingQueue works as well).
+  using QueryQueue = MPMCQueue<QueuedQuery>;
+
+  // Per-app forwarding state. A batch leaves when it is full or when its
+  // oldest query has waited max_wait, whichever comes first.
+  struct AppQueue
+  {
+    AppQueue(boost::asio::io_service &io, uint32_t handle, const std::string &app_id, size_t capacity,
+             OverflowPolicy policy, std::chrono::microseconds max_wait, Routing routing)
+        : handle(handle), app_id(app_id), queue(capacity, policy), max_wait(max_wait), routing(routing), ready(io), space(io) {}
+    uint32_t handle; // interned app id
+    std::string app_id;
+    QueryQueue queue;
+    std::chrono::microseconds max_wait;
+    Routing routing;
+    LatencyHistogram queueing_delay;
+    WindowedStats depth; // queued queries, sampled every second
+    AsyncEvent ready;    // set on every push, wakes the forwarder
+    AsyncEvent space;    // set when a full worker port it waits on drains
+    // Largest batch of the app's instances, what a batch fills up to.
+    std::atomic<size_t> batch_size{1};
+  };
+
+  // A variant deployed on a worker, what the load balancer picks from.
+  // outstanding and batches count what was sent to it and not COMPLETED
+  // yet; the service time of its batches is tracked as an EWMA with its
+  // variance, updated from the COMPLETED messages only. It holds ids and
+  // atomics only, never the DataStore's live objects.
+  struct Instance
+  {
+    Instance(int variant_id, int worker_id) : variant_id(variant_id), worker_id(worker_id) {}
+    const int variant_id;
+    const int worker_id;
+    std::atomic<int> outstanding{0};
+    std::atomic<int> batches{0};
+    std::atomic<double> service_us{0};
+    std::atomic<double> service_var{0};
+    std::atomic<bool> retired{false}; // stopped, out of the load balancer
+    // Copied from the DataStore snapshot on every load-balancer update (so
+    // from PROFILE_DATA), routing never reads the live Model.
+    std::atomic<float> throughput{0};
+    std::atomic<int> batch_size{1};
+  };
+
   void configure(const json config)
   {
     Engine::configure(config);
@@ -48,8 +106,40 @@ public:
       scheduler_ = new RoomieScheduler();
     }
 
-    incoming2_ = new InPort(get_incoming()[0]->get_host(), get_incoming()[0]->get_port() + 1, [this](Message msg)
-                            { this->push(msg); });
+    // Per-app query queues are bounded; shedding the oldest queries (the
+    // likeliest to miss their SLO anyway) keeps the loop threads that fill
+    // them from ever blocking.
+    query_queue_capacity_ = config_["parameters"].value("query_queue_capacity", query_queue_capacity_);
+    query_queue_policy_ = string2overflow(config_["parameters"].value("query_queue_policy", "drop_oldest"));
+    // Batching budget: "max_batch_wait_ms" for all apps, "batch_wait_ms"
+    // to override it per app.
+    max_batch_wait_ = std::chrono::microseconds(static_cast<int64_t>(1000 * config_["parameters"].value("max_batch_wait_ms", 50.0)));
+    if (config_["parameters"].contains("batch_wait_ms"))
+    {
+      for (auto &[app_id, wait_ms] : config_["parameters"]["batch_wait_ms"].items())
+      {
+        batch_wait_[app_id] = std::chrono::microseconds(static_cast<int64_t>(1000 * wait_ms.get<double>()));
+      }
+    }
+    // Routing: "routing" for all apps ("wrr", "least_outstanding" or
+    // "latency"), "app_routing" to override it per app. "service_time_alpha"
+    // weighs the latest batch in the service-time averages.
+    routing_ = string2routing(config_["parameters"].value("routing", "wrr"));
+    service_alpha_ = config_["parameters"].value("service_time_alpha", service_alpha_);
+    // A deployment neither DEPLOYED nor DEPLOY_FAILED by then is given up
+    // on and its memory released.
+    deployment_timeout_ = std::chrono::seconds(config_["parameters"].value("deployment_timeout_s", 120));
+    if (config_["parameters"].contains("app_routing"))
+    {
+      for (auto &[app_id, routing] : config_["parameters"]["app_routing"].items())
+      {
+        app_routing_[app_id] = string2routing(routing.get<std::string>());
+      }
+    }
+
+    incoming2_ = new InPort(io_pool_, get_incoming()[0]->get_host(), get_incoming()[0]->get_port() + 1, [this](Message msg)
+                            { this->push(msg); },
+                            get_transport());
 
     for (const auto &outport : outgoing_)
     {
@@ -63,168 +153,186 @@ public:
   {
     spdlog::debug("RUNNING CONTROLLER...");
 
+    // Auto-scaler, ready before any HELLO can let a registration through
+    autoscaler_ = new AutoScaler(scheduler_, &datastore_, [this](const std::string &app_id, Model &variant, Worker &worker)
+                                 { deploy(app_id, variant, worker); }, [this](const std::string &app_id, Model &variant, Worker &worker)
+                                 { stop(app_id, variant, worker); });
+    autoscaler_->run(io_pool_.get_io_service());
+
+    registrations();
+    profiles();
+    task_pool_.submit_every(std::chrono::seconds(1), [this]()
+                            { sample_queues(); }, Priority::LOW);
+    task_pool_.submit_every(std::chrono::seconds(1), [this]()
+                            { expire_deployments(); }, Priority::LOW);
+
     // Send HELLO messages to all outports
     for (auto &outport : outgoing_)
     {
-      Message msg("HELLO", {{"worker_id", std::to_string(outport->getId())}});
+      Message msg(Type::HELLO);
+      msg.set_int(Field::WORKER_ID, outport->getId());
       outport->push(msg);
     }
 
-    // Launch registration, profiling, and logging loops as background threads
-    std::thread registration_thread(&Controller::registration_daemon, this);
-    std::thread profiling_thread(&Controller::profiling_daemon, this);
-
-    // Auto-scaler
-    autoscaler_ = new AutoScaler(scheduler_, &datastore_, [this](const std::string &app_id, Model &variant, Worker &worker)
-                                 { deploy(app_id, variant, worker); }, [this](const std::string &app_id, Model &variant, Worker &worker)
-                                 { stop(app_id, variant, worker); });
-    std::thread autoscaler_thread = std::thread([this]()
-                                                { autoscaler_->run(); });
-
-    // Optionally join threads or coordinate their lifecycle
-    registration_thread.join();
-    profiling_thread.join();
-    autoscaler_thread.join();
+    // Registrations, profiles, forwarding and auto-scaling are coroutines
+    // on the io loop from here on.
+    task_pool_.join();
   }
 
-  void push(const Message &msg) override
+  json metrics() override
   {
-    // spdlog::debug("👉[controller] Recv " + msg.to_string() );
-    if (msg.getType() == "REGISTER")
+    json metrics = Engine::metrics();
+    metrics["incoming"].push_back(incoming2_->metrics());
+    metrics["unregistered_queries"] = unregistered_queries_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(query_queue_mutex_);
+    for (auto &app : app_queues_)
     {
-      registration_queue_.push(msg);
+      metrics["query_queues"][app->app_id] = {{"queued", app->queue.size()},
+                                              {"dropped", app->queue.dropped()},
+                                              {"queueing_delay", app->queueing_delay.summary()},
+                                              {"depth", app->depth.summary()}};
     }
-    else if (msg.getType() == "QUERY")
+    std::shared_lock<std::shared_mutex> instance_lock(instance_mutex_);
+    for (auto &instance : instances_owned_)
     {
-      query_queue_[msg.get_data()["app_id"]].push(msg);
-    }
-    else if (msg.getType() == "PROFILE_DATA")
-    {
-      profiling_queue_.push(msg);
-    }
-    else if (msg.getType() == "HELLO")
-    {
-      int worker_id = std::stoi(msg.get_data()["worker_id"]);
-      double total_mem = std::stod(msg.get_data()["total_mem"]);
-      Worker *worker = datastore_.get_worker(worker_id);
-      worker->set_total_memory(total_mem / 2);
-      spdlog::debug("👉[controller] Update for {}", worker->to_string());
-      event_.set();
+      metrics["instances"].push_back({{"variant_id", instance->variant_id},
+                                      {"worker_id", instance->worker_id},
+                                      {"outstanding", instance->outstanding.load()},
+                                      {"service_us", instance->service_us.load()},
+                                      {"service_stddev_us", std::sqrt(instance->service_var.load())}});
     }
-    else if (msg.getType() == "DEPLOYED")
+    return metrics;
+  }
+
+  void sample_queues()
+  {
+    std::lock_guard<std::mutex> lock(query_queue_mutex_);
+    for (auto &app : app_queues_)
     {
-      int worker_id = std::stoi(msg.get_data()["worker_id"]);
-      double free_memory = std::stod(msg.get_data()["free_memory"]);
-      Worker *worker = datastore_.get_worker(worker_id);
-      worker->set_deployment(false);
-      spdlog::debug("👉[controller] Deployment done for " + worker->to_string());
-      event_.set();
+      app->depth.push(app->queue.size());
     }
   }
 
-  void registration_daemon()
+  void push(const Message &msg) override
+  {
+    // spdlog::debug("👉[controller] Recv " + msg.to_string() );
+    (this->*HANDLERS[static_cast<size_t>(msg.getType())])(msg);
+  }
+
+  // Waits for a first worker HELLO, then registers apps as they come.
+  Job registrations()
   {
-    try
+    co_await schedule(io_pool_.get_io_service());
+    co_await event_.wait();
+    spdlog::debug("👉[controller] About to run registrations");
+    while (true)
     {
-      event_.wait();
-      spdlog::debug("👉[controller] About to run registration daemon");
-      while (true)
+      Message msg = co_await registration_queue_.pop();
+      try
       {
-        Message msg = registration_queue_.pop(); // blocks until message arrives
         spdlog::debug("👉[controller] New registration {}", msg.to_string());
-        std::map<std::string, std::string> variant_names = msg.get_data(); // assumed typed extraction
-        for (auto &[app_id, variant_name] : variant_names)
+        for (const auto &[app_id, variant_name] : msg.get_extra())
         {
           spdlog::debug("👉[controller] About to register app {}", app_id);
           datastore_.register_app(variant_name, variant_name);
-          std::vector<Worker *> workers = datastore_.get_workers();
+          auto snapshot = datastore_.snapshot();
+          std::vector<Worker *> workers = snapshot->get_workers();
           std::vector<std::string> names;
-          for (const auto name : datastore_.get_registered(app_id))
+          for (const auto name : snapshot->get_registered(app_id))
           {
             names.push_back(name);
           }
           std::pair<Model *, Worker *> result = scheduler_->schedule(workers, names);
           deploy(app_id, *result.first, *result.second);
 
-          forward_query_threads_.emplace_back([this, variant_name]()
-                                              {
-                                                query_daemon(variant_name); // starts query loop per variant
-                                              });
+          query_queue(apps_.intern(variant_name)).ready.set(); // picks up queries that arrived before the deployment
           spdlog::debug("👉[controller] Registered app {}", app_id);
         }
 
         autoscaler_->set_event();
       }
-    }
-    catch (const std::exception &e)
-    {
-      spdlog::error("⛔️ Error with registration daemon\n\t{}", e.what());
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️ Error with registrations\n\t{}", e.what());
+      }
     }
   }
 
-  void profiling_daemon()
+  Job profiles()
   {
-    try
+    co_await schedule(io_pool_.get_io_service());
+    while (true)
     {
-      while (true)
+      Message msg = co_await profiling_queue_.pop(); // [TODO] Update load balancing weights.
+      try
       {
-        auto msg = profiling_queue_.pop(); // [TODO] Update load balancing weights.
-
-        int worker_id = std::stoi(msg.get_data()["worker_id"]);
-        json j = json::parse(msg.get_data()["variants"]);
-        for (auto worker : datastore_.get_workers())
-        {
-          if (worker->get_id() == worker_id)
+        int worker_id = msg.get_int(Field::WORKER_ID);
+        std::string_view variants = msg.get(Field::VARIANTS);
+        json j = json::parse(variants.begin(), variants.end());
+        // The whole report lands in one DataStore version.
+        datastore_.update([&](DataStore::Writer &store)
+                          {
+          for (const auto &item : j)
           {
-            for (const auto &item : j)
+            auto [variant, worker] = store.instance(item["variant_id"].get<int>());
+            if (variant == nullptr || worker->get_id() != worker_id)
             {
-              for (auto variant : worker->get_variants())
-              {
-                if (variant->id == item["variant_id"].get<int>())
-                {
-                  variant->set_throughput(item["throughput"].get<float>());
-                  auto input_rates = item["input_rate"].get<std::vector<int>>();
-                  for (size_t i = 0; i < input_rates.size(); i++)
-                  {
-                    variant->input_rates[i] = input_rates[i];
-                  }
-                  break; // end for updating variant.
-                }
-              }
+              continue;
             }
-            break; // end for updating all variants.
-          }
-        }
+            variant->set_throughput(item["throughput"].get<float>());
+            variant->input_rates.assign(item["input_rate"].get<std::vector<int>>());
+          } });
         update_load_balancer();
       }
-    }
-    catch (const std::exception &e)
-    {
-      spdlog::error("⛔️ Error with profiling daemon\n\t{}", e.what());
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️ Error with profiles\n\t{}", e.what());
+      }
     }
   }
 
   void update_load_balancer()
   {
-    for (const auto &[app_id, names] : datastore_.get_registration())
+    std::lock_guard<std::mutex> routing_lock(routing_mutex_);
+    auto snapshot = datastore_.snapshot();
+    for (const auto &[app_id, names] : snapshot->get_registration())
     {
-      auto variant_workers = datastore_.get_variant_workers(app_id);
+      auto variant_workers = snapshot->get_variant_workers(app_id);
       if (variant_workers.empty())
       {
         continue;
       }
 
+      std::vector<uint32_t> keys;
       std::vector<double> raw_weights;
+      int batch_size = 1;
       for (const auto &pair : variant_workers)
       {
         Model *variant = pair.first;
+        Worker *worker = pair.second;
         double throughput = variant->compute_throughput();
         if (throughput == 0)
         {
           spdlog::error("Warning: Zero throughput for variant {}", variant->id);
           continue;
         }
+        // Instances keep ids and atomics only, the snapshot objects go away
+        // with it.
+        if (datastore_.get_variant_worker(variant->id).first == nullptr)
+        {
+          continue; // removed since the snapshot was taken
+        }
+        uint32_t handle = instance(variant->id, worker->get_id());
+        Instance *target = instances_.get(handle);
+        if (target->retired.load())
+        {
+          continue; // stopped after the snapshot was taken
+        }
+        target->throughput.store(variant->get_throughput(), std::memory_order_relaxed);
+        target->batch_size.store(std::max(1, variant->batch_size), std::memory_order_relaxed);
+        keys.push_back(handle);
         raw_weights.push_back(variant->compute_workload() / throughput);
+        batch_size = std::max(batch_size, variant->batch_size);
       }
 
       std::vector<int> weights;
@@ -240,97 +348,410 @@ public:
         weights.push_back(adjusted);
       }
 
-      for (size_t i = 0; i < variant_workers.size(); ++i)
+      // One swap per app: forwarders see the old table or the new one.
+      uint32_t app = apps_.intern(app_id);
+      loadb_.assign(app, std::move(keys), std::move(weights));
+      if (AppQueue *queue = query_queue_.get(app))
       {
-        const std::string key = std::to_string(variant_workers[i].first->id) + "_" + std::to_string(variant_workers[i].second->get_id());
-        variant_worker_map_[key] = {variant_workers[i].first, variant_workers[i].second};
-        loadb_.set(app_id, key, weights[i]);
+        queue->batch_size.store(batch_size, std::memory_order_relaxed);
       }
     }
     // spdlog::debug("👉[controller] Updated load-balancing: " + loadb_.to_string() );
   }
 
+  // The variant joins the worker in the DataStore on DEPLOYED, its memory
+  // is reserved until then (or until DEPLOY_FAILED or the timeout).
   void deploy(const std::string &app_id, Model &variant, Worker &worker)
   {
-    if (worker.percent_occupation(variant.get_memory()) > MAX_GPU_MEMORY_OCCUPANCY)
+    variant.id = get_generator()->next();
+    if (!datastore_.reserve(worker.get_id(), &variant, MAX_GPU_MEMORY_OCCUPANCY, deployment_timeout_))
     {
       throw std::runtime_error("⛔️[controller] error " + variant.to_string() + " to " + worker.to_string() + "\n\t| New occupancy: " + std::to_string(worker.percent_occupation(variant.get_memory())) + " (%)");
     }
-    worker.set_deployment(true);
-    variant.id = get_generator()->next();
-    std::map<std::string, std::string> data = {
-        {"id", std::to_string(variant.id)},
-        {"name", variant.name},
-        {"batch_size", std::to_string(variant.batch_size)},
-    };
-    Message msg("DEPLOY", data);
+    datastore_.update([&](DataStore::Writer &store)
+                      { store.worker(worker.get_id())->set_deployment(true); });
+    Message msg(Type::DEPLOY);
+    msg.set_int(Field::ID, variant.id);
+    msg.set(Field::NAME, variant.name);
+    msg.set_int(Field::BATCH_SIZE, variant.batch_size);
 
     send(worker, msg);
-    // worker.add_variant(&variant);
-    if (datastore_.push(worker.get_id(), &variant) == nullptr)
-    {
-      spdlog::error("⛔️ Error adding variant to worker");
-    }
   }
 
   void stop(const std::string &app_id, Model &variant, Worker &worker)
   {
-    std::map<std::string, std::string> data = {
-        {"variant_id", std::to_string(variant.id)},
-        {"variant_name", variant.name},
-    };
-    Message msg("STOP", data);
+    Message msg(Type::STOP);
+    msg.set_int(Field::VARIANT_ID, variant.id);
+    msg.set(Field::VARIANT_NAME, variant.name);
     send(worker, msg);
     datastore_.remove(worker.get_id(), &variant);
+    // Out of the table first, so a forwarder that sees it retired and picks
+    // again gets another instance.
+    std::lock_guard<std::mutex> routing_lock(routing_mutex_);
+    std::shared_lock<std::shared_mutex> lock(instance_mutex_);
+    auto it = instance_handles_.find(variant.id);
+    if (it != instance_handles_.end())
+    {
+      if (auto app = apps_.find(app_id))
+      {
+        loadb_.remove(app.value(), it->second);
+      }
+      instances_.get(it->second)->retired.store(true);
+    }
     spdlog::debug("👉[controller] Will stop {} at {}", variant.to_string(), worker.to_string());
   }
 
   void send(Worker &worker, const Message &msg)
   {
-    networking_[worker.get_id()]->push(msg);
+    send(worker.get_id(), msg);
   }
 
-  void query_daemon(const std::string &app_id)
+  void send(int worker_id, const Message &msg)
   {
-    spdlog::debug("😎 Query forwarder will start for application " + app_id);
+    networking_[worker_id]->push(msg);
+  }
+
+  // For the io loop: false, and on_space runs later, when the port is full.
+  bool try_send(int worker_id, const Message &msg, std::function<void()> on_space)
+  {
+    return networking_[worker_id]->try_push(msg, std::move(on_space));
+  }
+
+private:
+  using Handler = void (Controller::*)(const Message &);
+
+  // One per app, started with its queue. Sends every batch that is full or
+  // due and otherwise sleeps until a query comes in or the deadline passes.
+  Job forward(AppQueue &app)
+  {
+    auto &io = io_pool_.get_io_service();
+    co_await schedule(io);
+    spdlog::debug("😎 Query forwarder will start for application " + app.app_id);
+    std::vector<QueuedQuery> batch;
+    RoutingCursor cursor;
     while (true)
     {
-      std::optional<std::string> key = loadb_.next(app_id);
+      size_t batch_size = app.batch_size.load(std::memory_order_relaxed);
+      if (batch.size() < batch_size)
+      {
+        app.queue.try_drain_into(batch, batch_size - batch.size());
+      }
+      if (batch.empty())
+      {
+        co_await app.ready.wait();
+        continue;
+      }
 
-      if (key.has_value())
+      auto now = std::chrono::steady_clock::now();
+      auto deadline = batch.front().arrival + app.max_wait;
+      if (batch.size() < batch_size && now < deadline)
       {
-        auto [variant, worker] = variant_worker_map_[key.value()];
-        for (size_t i = 0; i < variant->batch_size; i++)
-        {
-          query_queue_[app_id].pop(); // blocking wait on a per-app queue
-        }
-        Message msg("QUERY", {{"variant_id", std::to_string(variant->id)}, {"batch_size", std::to_string(variant->batch_size)}});
-        msg.append_data("variant_id", std::to_string(variant->id));
-        send(*worker, msg);
+        co_await app.ready.wait_until(deadline);
+        continue;
       }
-      else
+
+      // Picked only now, on the costs and the table of the moment: nothing
+      // is awaited between here and the send.
+      std::optional<uint32_t> handle = pick(app, cursor);
+      if (!handle.has_value())
       {
-        spdlog::error("No variant instance found for the application {}", app_id);
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        spdlog::error("No variant instance found for the application {}", app.app_id);
+        co_await sleep_for(io, std::chrono::seconds(1));
+        continue;
+      }
+      Instance *target = instances_.get(handle.value());
+      if (target == nullptr || target->retired.load())
+      {
+        // Stopped since the table was read. Removing it again is a no-op
+        // unless it came back; either way the next pick does not see it.
+        loadb_.remove(app.handle, handle.value());
+        co_await schedule(io);
+        continue;
       }
+
+      // A batch filled for a larger instance leaves in parts. The worker
+      // runs the real count, a partial batch included.
+      size_t count = std::min<size_t>(batch.size(), target->batch_size.load(std::memory_order_relaxed));
+      Message msg(Type::QUERY);
+      msg.set_int(Field::VARIANT_ID, target->variant_id);
+      msg.set_int(Field::BATCH_SIZE, count);
+      target->outstanding += count;
+      target->batches++;
+      // This runs on the io loop, which must not block: with the worker's
+      // port full, the batch stays here (and the app queue fills up and
+      // sheds per its policy) until the port drains.
+      if (!try_send(target->worker_id, msg, [&app]()
+                    { app.space.set(); }))
+      {
+        target->outstanding -= count;
+        target->batches--;
+        co_await app.space.wait_until(std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+        continue;
+      }
+      for (size_t i = 0; i < count; i++)
+      {
+        app.queueing_delay.record(std::chrono::duration_cast<std::chrono::microseconds>(now - batch[i].arrival).count());
+      }
+      batch.erase(batch.begin(), batch.begin() + count);
     }
   }
 
-private:
-  Event event_;
+  std::optional<uint32_t> pick(const AppQueue &app, RoutingCursor &cursor)
+  {
+    switch (app.routing)
+    {
+    case Routing::LEAST_OUTSTANDING:
+      return loadb_.next_least(app.handle, cursor, [this](uint32_t handle)
+                               { return outstanding_work(handle); });
+    case Routing::LATENCY:
+      return loadb_.next_min(app.handle, cursor, [this](uint32_t handle)
+                             { return predicted_completion(handle); });
+    default:
+      return loadb_.next(app.handle, cursor);
+    }
+  }
+
+  // Microseconds until a batch sent now would be done: the batches ahead
+  // of it and its own at the mean service time, plus one standard
+  // deviation so instances with erratic service times (e.g. co-located
+  // variants interfering) rank lower. Until the first COMPLETED the mean
+  // comes from the profiled throughput.
+  double predicted_completion(uint32_t handle)
+  {
+    Instance *instance = instances_.get(handle);
+    double mean = instance->service_us.load(std::memory_order_relaxed);
+    if (mean <= 0)
+    {
+      mean = 1e6 * instance->batch_size.load(std::memory_order_relaxed) /
+             std::max(instance->throughput.load(std::memory_order_relaxed), 1e-3f);
+    }
+    double batches = instance->batches.load(std::memory_order_relaxed) + 1;
+    return batches * mean + std::sqrt(instance->service_var.load(std::memory_order_relaxed));
+  }
+
+  // Seconds the instance needs to clear what it was sent, plus one query
+  // so idle instances still rank by throughput.
+  double outstanding_work(uint32_t handle)
+  {
+    Instance *instance = instances_.get(handle);
+    double throughput = std::max(instance->throughput.load(std::memory_order_relaxed), 1e-3f);
+    return (instance->outstanding.load(std::memory_order_relaxed) + 1) / throughput;
+  }
+
+  // Only registered apps have a queue; queries for any other app id are
+  // dropped, not interned, so the network cannot create queues.
+  void on_query(const Message &msg)
+  {
+    std::optional<uint32_t> handle = apps_.find(msg.get(Field::APP_ID));
+    AppQueue *queue = handle.has_value() ? query_queue_.get(handle.value()) : nullptr;
+    if (queue == nullptr)
+    {
+      if (unregistered_queries_.fetch_add(1, std::memory_order_relaxed) == 0)
+      {
+        spdlog::warn("⛔️[controller] Dropping queries for unregistered app {}", msg.get(Field::APP_ID));
+      }
+      return;
+    }
+    AppQueue &app = *queue;
+    app.queue.push(QueuedQuery{msg, std::chrono::steady_clock::now()});
+    app.ready.set();
+  }
+
+  void on_completed(const Message &msg)
+  {
+    std::shared_lock<std::shared_mutex> lock(instance_mutex_);
+    auto it = instance_handles_.find(msg.get_int(Field::VARIANT_ID));
+    if (it != instance_handles_.end())
+    {
+      Instance *instance = instances_.get(it->second);
+      instance->outstanding -= msg.get_int(Field::BATCH_SIZE);
+      instance->batches--;
+      if (msg.has(Field::SERVICE_US))
+      {
+        record_service(*instance, msg.get_int(Field::SERVICE_US));
+      }
+    }
+  }
+
+  // Exponentially weighted mean and variance; a worker's COMPLETED
+  // messages come in order from one connection, so there is one writer.
+  void record_service(Instance &instance, double service_us)
+  {
+    double mean = instance.service_us.load(std::memory_order_relaxed);
+    if (mean <= 0)
+    {
+      instance.service_us.store(service_us, std::memory_order_relaxed);
+      return;
+    }
+    double diff = service_us - mean;
+    double increment = service_alpha_ * diff;
+    double var = instance.service_var.load(std::memory_order_relaxed);
+    instance.service_us.store(mean + increment, std::memory_order_relaxed);
+    instance.service_var.store((1 - service_alpha_) * (var + diff * increment), std::memory_order_relaxed);
+  }
+
+  // The queues are created on arrival, queries that come in while the
+  // registration is pending wait in them.
+  void on_register(const Message &msg)
+  {
+    for (const auto &[app_id, variant_name] : msg.get_extra())
+    {
+      query_queue(apps_.intern(variant_name));
+    }
+    registration_queue_.push(msg);
+  }
+
+  void on_profile_data(const Message &msg)
+  {
+    profiling_queue_.push(msg);
+  }
+
+  void on_hello(const Message &msg)
+  {
+    int worker_id = msg.get_int(Field::WORKER_ID);
+    double total_mem = msg.get_double(Field::TOTAL_MEM);
+    datastore_.update([&](DataStore::Writer &store)
+                      {
+      Worker *worker = store.worker(worker_id);
+      worker->set_total_memory(total_mem / 2);
+      spdlog::debug("👉[controller] Update for {}", worker->to_string()); });
+    event_.set();
+  }
+
+  void on_deployed(const Message &msg)
+  {
+    int worker_id = msg.get_int(Field::WORKER_ID);
+    if (datastore_.commit(msg.get_int(Field::VARIANT_ID)) == nullptr)
+    {
+      // Given up on already, its memory is no longer reserved: not kept.
+      spdlog::error("⛔️ Error adding variant {} to worker {}, stopping it", msg.get_int(Field::VARIANT_ID), worker_id);
+      Message stop(Type::STOP);
+      stop.set_int(Field::VARIANT_ID, msg.get_int(Field::VARIANT_ID));
+      send(worker_id, stop);
+    }
+    datastore_.update([&](DataStore::Writer &store)
+                      {
+      Worker *worker = store.worker(worker_id);
+      worker->set_deployment(false);
+      spdlog::debug("👉[controller] Deployment done for " + worker->to_string()); });
+    event_.set();
+  }
+
+  void on_deploy_failed(const Message &msg)
+  {
+    spdlog::error("⛔️[controller] Worker {} failed to deploy variant {}", msg.get_int(Field::WORKER_ID), msg.get_int(Field::VARIANT_ID));
+    abort_deployment(msg.get_int(Field::VARIANT_ID));
+  }
+
+  // Every second: the deployments past their timeout are given up on.
+  void expire_deployments()
+  {
+    for (int variant_id : datastore_.expired(std::chrono::steady_clock::now()))
+    {
+      spdlog::error("⛔️[controller] Deployment of variant {} timed out", variant_id);
+      abort_deployment(variant_id);
+    }
+  }
+
+  // Releases the reserved memory and lets the worker take deployments again.
+  void abort_deployment(int variant_id)
+  {
+    Worker *worker = datastore_.cancel(variant_id);
+    if (worker == nullptr)
+    {
+      return;
+    }
+    datastore_.update([&](DataStore::Writer &store)
+                      { store.worker(worker->get_id())->set_deployment(false); });
+  }
+
+  void ignore(const Message &msg) {}
+
+  // Indexed by Type, keep in the enum order.
+  static constexpr Handler HANDLERS[NUM_TYPES] = {
+      &Controller::on_query,        // QUERY
+      &Controller::on_hello,        // HELLO
+      &Controller::ignore,          // FINISHED
+      &Controller::on_register,     // REGISTER
+      &Controller::on_profile_data, // PROFILE_DATA
+      &Controller::on_deployed,     // DEPLOYED
+      &Controller::ignore,          // STOP
+      &Controller::ignore,          // DEPLOY
+      &Controller::ignore,          // CREDIT
+      &Controller::on_completed,    // COMPLETED
+      &Controller::on_deploy_failed, // DEPLOY_FAILED
+  };
+
+  // Lock-free once the app has its queue; the registration of an app
+  // creates it and starts its forwarder.
+  AppQueue &query_queue(uint32_t handle)
+  {
+    if (AppQueue *app = query_queue_.get(handle))
+      return *app;
+    std::lock_guard<std::mutex> lock(query_queue_mutex_);
+    if (AppQueue *app = query_queue_.get(handle))
+      return *app;
+    const std::string &app_id = apps_.name(handle);
+    auto wait = batch_wait_.find(app_id);
+    auto routing = app_routing_.find(app_id);
+    auto &app = app_queues_.emplace_back(std::make_unique<AppQueue>(io_pool_.get_io_service(), handle, app_id,
+                                                                     query_queue_capacity_, query_queue_policy_,
+                                                                     wait != batch_wait_.end() ? wait->second : max_batch_wait_,
+                                                                     routing != app_routing_.end() ? routing->second : routing_));
+    query_queue_.set(handle, app.get());
+    forward(*app);
+    return *app;
+  }
+
+  // Dense handle of the instance of a variant on a worker, allocated the
+  // first time the load balancer sees it.
+  uint32_t instance(int variant_id, int worker_id)
+  {
+    std::lock_guard<std::shared_mutex> lock(instance_mutex_);
+    auto it = instance_handles_.find(variant_id);
+    if (it != instance_handles_.end())
+    {
+      return it->second;
+    }
+    uint32_t handle = instances_owned_.size();
+    instances_owned_.push_back(std::make_unique<Instance>(variant_id, worker_id));
+    instances_.set(handle, instances_owned_.back().get());
+    instance_handles_[variant_id] = handle;
+    return handle;
+  }
+
+  AsyncEvent event_{io_pool_.get_io_service()}; // first worker HELLO
   LoadBalancer loadb_;
   Scheduler *scheduler_;
   AutoScaler *autoscaler_;
   DataStore datastore_;
   InPort *incoming2_;
   std::map<int, OutPort *> networking_;
-  // Queues and data
-  std::unordered_map<std::string, BlockingQueue<Message>> query_queue_;
-  BlockingQueue<Message> profiling_queue_;
-  BlockingQueue<Message> registration_queue_;
+  // Queues and data, indexed by app handle
+  Interner apps_;
+  std::atomic<uint64_t> unregistered_queries_{0}; // dropped by on_query
+  HandleTable<AppQueue> query_queue_;
+  std::vector<std::unique_ptr<AppQueue>> app_queues_;
+  std::mutex query_queue_mutex_;
+  size_t query_queue_capacity_ = 10000;
+  OverflowPolicy query_queue_policy_ = OverflowPolicy::DROP_OLDEST;
+  std::chrono::microseconds max_batch_wait_{50000};
+  std::map<std::string, std::chrono::microseconds, std::less<>> batch_wait_;
+  Routing routing_ = Routing::WRR;
+  double service_alpha_ = 0.2;
+  std::chrono::steady_clock::duration deployment_timeout_ = std::chrono::minutes(2);
+  std::map<std::string, Routing, std::less<>> app_routing_;
+  AsyncQueue<Message> profiling_queue_{io_pool_.get_io_service()};
+  AsyncQueue<Message> registration_queue_{io_pool_.get_io_service()};
 
-  std::vector<std::thread> forward_query_threads_;
-  std::unordered_map<std::string, std::pair<Model *, Worker *>> variant_worker_map_;
+  // Variant instances, indexed by the handles the load balancer returns
+  HandleTable<Instance> instances_;
+  std::vector<std::unique_ptr<Instance>> instances_owned_;
+  std::unordered_map<int, uint32_t> instance_handles_; // variant id -> handle
+  std::shared_mutex instance_mutex_;                  // guards the two above
+  // Held by update_load_balancer() from the retired checks to the publish
+  // and by stop() to retire, so a retired instance is never published again.
+  std::mutex routing_mutex_;
 };
 
 #endif // CONTROLLER_H
\ No newline at end of file
@@ -3,10 +3,12 @@
 
 #include <string>
 #include <vector>
+#include <thread>
 #include <fstream>
 #include <filesystem>
 #include <nlohmann/json.hpp>
 #include "utils/general.h"
+#include "utils/task_pool.h"
 #include "networking/port.h"
 #include "networking/message.h"
 
@@ -23,7 +25,11 @@ protected:
   std::string log_directory_;
   std::vector<InPort *> incoming_;
   std::vector<OutPort *> outgoing_;
-  RandomGenerator generator_;
+  // Event loop of every port of the engine ("io_threads" in the parameters).
+  IoPool io_pool_;
+  // Daemons, timers and background jobs ("task_threads" in the parameters).
+  TaskPool task_pool_;
+  IdAllocator generator_;
 
 public:
   virtual void configure(const json config)
@@ -35,19 +41,22 @@ public:
     {
       log_directory_ = config_["parameters"]["log_dir"];
     }
+    io_pool_.start(config_["parameters"].value("io_threads", 2));
+    task_pool_.start(config_["parameters"].value("task_threads", 4));
 
     if (config_.contains("host") && config_.contains("port") && config_["port"].get<int>() > 0)
     {
-      auto in = new InPort(config_["host"], config_["port"],
+      auto in = new InPort(io_pool_, config_["host"], config_["port"],
                            [this](const Message &msg)
-                           { push(msg); });
+                           { push(msg); },
+                           get_transport());
       incoming_.push_back(in);
     }
     for (auto &remote : config_["remote_engines"])
     {
       int worker_id = generator_.next();
       remote["id"] = worker_id;
-      auto out = new OutPort(worker_id, remote["remote_host"], remote["remote_port"]);
+      auto out = new OutPort(io_pool_, worker_id, remote["remote_host"], remote["remote_port"], OutPortOptions::from_json(remote));
       outgoing_.push_back(out);
     }
   }
@@ -64,6 +73,14 @@ public:
 
   void start()
   {
+    // Optional periodic dump of the port metrics ("metrics_interval_ms").
+    int metrics_interval = config_["parameters"].value("metrics_interval_ms", 0);
+    if (metrics_interval > 0)
+    {
+      task_pool_.submit_every(std::chrono::milliseconds(metrics_interval), [this]()
+                              { spdlog::info("📊[{}] {}", engine_name_, metrics().dump()); }, Priority::LOW);
+    }
+
     try
     {
       run(); // This could be a blocking loop
@@ -78,6 +95,22 @@ public:
     std::cout << "--- " + engine_name_ + " terminated! ---" << std::endl;
   }
 
+  // Queue depths, drop counts and credits of the ports, task pool counters.
+  virtual json metrics()
+  {
+    json incoming = json::array();
+    for (auto in : incoming_)
+    {
+      incoming.push_back(in->metrics());
+    }
+    json outgoing = json::array();
+    for (auto out : outgoing_)
+    {
+      outgoing.push_back(out->metrics());
+    }
+    return {{"incoming", incoming}, {"outgoing", outgoing}, {"tasks", task_pool_.metrics()}};
+  }
+
   std::vector<OutPort *> get_outgoing()
   {
     return outgoing_;
@@ -88,7 +121,23 @@ public:
     return incoming_;
   }
 
-  RandomGenerator *get_generator()
+  // Transport the engine listens with, remotes pick theirs in "remote_engines".
+  TransportKind get_transport() const
+  {
+    return string2transport(config_.value("transport", "ws"));
+  }
+
+  IoPool &get_io_pool()
+  {
+    return io_pool_;
+  }
+
+  TaskPool &get_task_pool()
+  {
+    return task_pool_;
+  }
+
+  IdAllocator *get_generator()
   {
     return &generator_;
   }
@@ -1,6 +1,7 @@
 #ifndef POISSON_ZIPF_QG_H
 #define POISSON_ZIPF_QG_H
 
+#include <atomic>
 #include <thread>
 #include <future>
 #include <chrono>
@@ -23,7 +24,6 @@ private:
   std::vector<std::string> domain_;
   std::string path_;
   int qps_;
-  std::map<std::string, int> counter_;
 
 public:
   void configure(const json config)
@@ -44,7 +44,7 @@ public:
     {
       regis_data[name] = name;
     }
-    Message msg("REGISTER", regis_data);
+    Message msg(Type::REGISTER, regis_data);
     outgoing_[0]->push(msg);
 
     std::string names = "";
@@ -56,34 +56,49 @@ public:
     auto data = loadTrace(path_);
     const int N = domain_.size();
 
-    for (auto [idx, timestamps] : data)
+    // One timer chain per trace on the task pool, instead of a sleeping
+    // thread each.
+    for (auto &[idx, timestamps] : data)
     {
       std::string model = domain_[idx % N];
-      forward_query_threads_.emplace_back([this, model, timestamps]()
-                                          { sendQueries(model, timestamps); });
+      std::sort(timestamps.begin(), timestamps.end());
+      senders_.push_back(Sender{model, std::move(timestamps), 0});
     }
-
-    // DEBUG
-    forward_query_threads_.emplace_back([this]()
-                                        { debug(); });
-    // DEBUG
-
-    auto start = std::chrono::steady_clock::now();
-    while (std::any_of(forward_query_threads_.begin(), forward_query_threads_.end(), [](std::thread &t)
-                       { return t.joinable(); }))
+    start_ = std::chrono::steady_clock::now();
+    remaining_ = senders_.size();
+    if (senders_.empty())
     {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-      auto now = std::chrono::steady_clock::now();
-      double elapsed = std::chrono::duration<double>(now - start).count();
-      // spdlog::debug( "Progress: " << std::min(elapsed, duration_) << " / " << duration_ << " seconds\r";
+      done_.set();
     }
+    for (auto &sender : senders_)
+    {
+      sendQueries(sender);
+    }
+
+    task_pool_.submit_every(std::chrono::seconds(1), [this]()
+                            { debug(); }, Priority::LOW);
 
-    Message finished_msg("FINISHED");
+    done_.wait();
+
+    Message finished_msg(Type::FINISHED);
     outgoing_[0]->push(finished_msg);
   }
 
 private:
-  std::vector<std::thread> forward_query_threads_;
+  struct Sender
+  {
+    std::string app_id;
+    std::vector<double> timestamps; // seconds from start_, sorted
+    size_t next;
+  };
+
+  std::vector<Sender> senders_;
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<size_t> remaining_{0};
+  Event done_;
+  // Senders run concurrently on the pool, the debug task reads it.
+  std::atomic<uint64_t> sent_{0};
+  uint64_t last_sent_ = 0; // debug task only
 
   std::unordered_map<int, std::vector<double>> loadTrace(const std::string &filepath)
   {
@@ -110,38 +125,37 @@ private:
     return data;
   }
 
-  void sendQueries(const std::string &app_id, std::vector<double> timestamps)
+  // Sends the queries that are due, then sleeps on a timer until the next.
+  void sendQueries(Sender &sender)
   {
-    counter_[app_id] = 0;
-    std::sort(timestamps.begin(), timestamps.end());
-    double time = 0;
-    for (const double timestamp : timestamps)
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    size_t first = sender.next;
+    for (; sender.next < sender.timestamps.size() && sender.timestamps[sender.next] <= elapsed; sender.next++)
     {
-      std::this_thread::sleep_for(std::chrono::duration<double>(timestamp - time));
-      Message msg(std::chrono::system_clock::now().time_since_epoch().count(), "QUERY", {{"app_id", app_id}});
+      Message msg(Type::QUERY, std::chrono::system_clock::now().time_since_epoch().count());
+      msg.set(Field::APP_ID, sender.app_id);
       outgoing_[0]->push(msg);
-      time = timestamp;
-      counter_[app_id]++;
+    }
+    sent_.fetch_add(sender.next - first, std::memory_order_relaxed);
+    if (sender.next < sender.timestamps.size())
+    {
+      auto when = start_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                               std::chrono::duration<double>(sender.timestamps[sender.next]));
+      task_pool_.submit_at(when, [this, &sender]()
+                           { sendQueries(sender); }, Priority::HIGH);
+    }
+    else if (--remaining_ == 0)
+    {
+      done_.set();
     }
   }
 
+  // Every second: queries sent since the previous call.
   void debug()
   {
-    while (true)
-    {
-      int start_total = 0;
-      int end_total = 0;
-      for (const auto [_, count] : counter_)
-      {
-        start_total += count;
-      }
-      std::this_thread::sleep_for(std::chrono::duration<double>(1));
-      for (const auto [_, count] : counter_)
-      {
-        end_total += count;
-      }
-      // spdlog::debug( "QPS: " + std::to_string(end_total - start_total) << std::endl;
-    }
+    uint64_t sent = sent_.load(std::memory_order_relaxed);
+    spdlog::debug("📊[generator] QPS: {}", sent - last_sent_);
+    last_sent_ = sent;
   }
 };
 
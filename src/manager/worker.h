@@ -18,6 +18,7 @@
 #include <c10/cuda/CUDAStream.h>
 #include "engine.h"
 #include "utils/queue.h"
+#include "utils/stats.h"
 #include "utils/datastore.h"
 #include "utils/csv_writer.h"
 #include "networking/port.h"
@@ -29,6 +30,16 @@ using json = nlohmann::json;
 
 class WorkerEngine : public Engine
 {
+  // Per deployed variant: fed by the InPort drain, read by its inference
+  // thread. A stopped queue is dropped by its thread at the next item.
+  struct InferenceQueue
+  {
+    explicit InferenceQueue(size_t capacity) : ring(capacity) {}
+    HybridSPSCQueue<int> ring;
+    std::atomic<bool> stopped{false};
+    std::atomic<int> received{0}; // queries accepted, sampled by the monitor
+  };
+
 public:
   void configure(const json config)
   {
@@ -42,103 +53,70 @@ public:
   void run() override
   {
     spdlog::debug("RUNNING WORKER...");
-    std::thread registration_thread(&WorkerEngine::deployment_daemon, this);
-    std::thread monitor_thread(&WorkerEngine::monitor_daemon, this);
-    std::thread monitor_incoming_thread(&WorkerEngine::monitor_incoming_data, this);
-    registration_thread.join();
-    monitor_thread.join();
-    monitor_incoming_thread.join();
+    task_pool_.submit_every(std::chrono::seconds(1), [this]()
+                            { monitor_incoming_data(); }, Priority::LOW);
+    task_pool_.submit_every(std::chrono::seconds(5), [this]()
+                            { monitor_daemon(); }, Priority::LOW);
+    task_pool_.join();
   }
 
   void push(const Message &msg) override
   {
     // spdlog::debug( "👉[WORKER] Recv: " << msg.to_string() << std::endl;
-    if (msg.getType() == "DEPLOY")
-    {
-      deployment_queue_.push(msg);
-    }
-    else if (msg.getType() == "QUERY")
-    {
-      if (inference_queue_.find(msg.get_data()["variant_id"]) != inference_queue_.end())
-      {
-        inference_queue_[msg.get_data()["variant_id"]]->push(1); // [TODO] push actual data.
-        num_received_[msg.get_data()["variant_id"]] += std::stoi(msg.get_data()["batch_size"]);
-      }
-    }
-    else if (msg.getType() == "STOP")
-    {
-      inference_queue_[msg.get_data()["variant_id"]]->push(0);
-    }
-    else if (msg.getType() == "HELLO")
+    (this->*HANDLERS[static_cast<size_t>(msg.getType())])(msg);
+  }
+
+  // Every second: queries received per variant since the previous call.
+  void monitor_incoming_data()
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    for (const auto &[variant_id, queue] : inference_queue_)
     {
-      spdlog::debug("👉[WORKER] Hello messge received: {}", msg.to_string());
-      id_ = std::stoi(msg.get_data()["worker_id"]);
-      engine_name_ = "WorkerEngine-" + msg.get_data()["worker_id"];
-      size_t free_memory;
-      size_t total_memory;
-      cudaMemGetInfo(&free_memory, &total_memory);
-      spdlog::debug("Total memory: {} MB | Free memory: {} MB", total_memory / (1024.0 * 1024), free_memory / (1024.0 * 1024));
-      total_mem_ = total_memory;
-      Message hello_msg("HELLO", {{"worker_id", msg.get_data()["worker_id"]}, {"total_mem", std::to_string(total_mem_)}});
-      outgoing_[0]->push(hello_msg);
-
-      std::string logpath = config_["parameters"]["log_dir"].get<std::string>() + "_worker_" + std::to_string(id_) + ".csv";
-      // Create a logger
-      async_file = spdlog::basic_logger_mt<spdlog::async_factory>("async_file_logger", logpath, true);
-      // Set a custom format string
-      async_file->set_pattern("%v");
-      async_file->set_level(spdlog::level::debug);
-      async_file->debug("{},{},{},{},{}", "timestamp", "worker_id", "variant_id", "variant_name", "batch_size");
+      int num_received = queue->received.load(std::memory_order_relaxed);
+      int received = num_received - input_rate_[variant_id];
+      running_variant_[variant_id]->input_rates.push(received);
+      incoming_stats_[variant_id].push(received);
+      input_rate_[variant_id] = num_received;
     }
   }
 
-  void monitor_incoming_data()
+  json metrics() override
   {
-    std::map<std::string, int> input_rate;
-    while (true)
+    json metrics = Engine::metrics();
+    metrics["rejected_queries"] = rejected_.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    for (const auto &[variant_id, stats] : incoming_stats_)
     {
-      input_rate.clear();
-      for (const auto [variant_id, num_received] : num_received_)
-      {
-        input_rate[variant_id] = num_received;
-      }
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-      for (auto [variant_id, num_received] : num_received_)
-      {
-        int size(running_variant_[variant_id]->input_rates.size());
-        // Shift elements to the right
-        for (int i = size - 1; i > 0; --i)
-        {
-          running_variant_[variant_id]->input_rates[i] = running_variant_[variant_id]->input_rates[i - 1];
-        }
-        running_variant_[variant_id]->input_rates[0] = num_received - input_rate[variant_id];
-      }
+      metrics["input_rate"][std::to_string(variant_id)] = stats.summary();
     }
+    return metrics;
   }
 
+  // Every 5 seconds: throughput and input rates to the controller.
   void monitor_daemon()
   {
     try
     {
-      while (true)
+      json j;
       {
-        std::this_thread::sleep_for(std::chrono::seconds(5));
-        std::vector<std::string> items;
-        json j;
+        std::lock_guard<std::mutex> lock(stats_mutex_);
         for (const auto [_, variant] : running_variant_)
         {
           j.push_back({
               {"variant_id", variant->id},
               {"variant_name", variant->name},
               {"throughput", variant->get_throughput()},
-              {"input_rate", variant->input_rates},
+              {"input_rate", variant->input_rates.values()},
           });
         }
-        std::map<std::string, std::string> data = {{"worker_id", std::to_string(id_)}, {"variants", j.dump()}};
-        Message msg("PROFILE_DATA", data);
-        outgoing_[0]->push(msg);
-        // spdlog::debug( "👉[WORKER] Monitoring with " + msg.to_string() << std::endl;
       }
+      // Outside the lock: a full outgoing queue blocks here, on_query must
+      // not wait behind it.
+      Message msg(Type::PROFILE_DATA);
+      msg.set_int(Field::WORKER_ID, id_);
+      msg.set(Field::VARIANTS, j.dump());
+      outgoing_[0]->push(msg);
+      // spdlog::debug( "👉[WORKER] Monitoring with " + msg.to_string() << std::endl;
     }
     catch (const std::exception &e)
     {
@@ -146,22 +124,26 @@ public:
     }
   }
 
+  // Inference loops keep a thread each: the CUDA stream and the module are
+  // bound to it, and forward() blocks on the device.
   void deployment_daemon()
   {
     try
     {
-      while (true)
+      Message msg;
+      while (deployment_queue_.try_pop(msg))
       {
-        auto msg = deployment_queue_.pop(); // blocks until message arrives
         // spdlog::debug( "👉[WORKER] About to deploy " << msg.to_string() << std::endl;
         Model *model = new Model();
-        model->id = std::stoi(msg.get_data()["id"]);
-        model->name = msg.get_data()["name"];
-        model->batch_size = std::stoi(msg.get_data()["batch_size"]);
-        running_variant_[msg.get_data()["id"]] = model;
-        num_received_[msg.get_data()["id"]] = 0;
-        auto queue = new BlockingQueue<int>();
-        inference_queue_[msg.get_data()["id"]] = queue;
+        model->id = msg.get_int(Field::ID);
+        model->name = msg.get(Field::NAME);
+        model->batch_size = msg.get_int(Field::BATCH_SIZE);
+        auto queue = std::make_shared<InferenceQueue>(config_["parameters"].value("inference_queue_capacity", 8192));
+        {
+          std::lock_guard<std::mutex> lock(stats_mutex_);
+          running_variant_[model->id] = model;
+          inference_queue_[model->id] = queue;
+        }
         inference_threads_.emplace_back([this, model, queue]()
                                         { run_inference(model, queue); });
       }
@@ -172,8 +154,9 @@ public:
     }
   }
 
-  void run_inference(Model *model, BlockingQueue<int> *queue)
+  void run_inference(Model *model, std::shared_ptr<InferenceQueue> queue)
   {
+    bool deployed = false;
     try
     {
       string model_filename = "data/models/" + model->name + ".pt";
@@ -192,34 +175,48 @@ public:
       size_t total_memory;
       cudaMemGetInfo(&free_memory, &total_memory);
       spdlog::debug("⚠️ [worker] New deployment\n\t| Name: {}\n\t| Batch-size: {}\n\t| Free-memory: {} MB", model->name, model->batch_size, free_memory / (1024.0 * 1024));
-      Message msg("DEPLOYED", {{"worker_id", std::to_string(id_)}, {"free_memory", std::to_string(free_memory)}, {"total_memory", std::to_string(total_memory)}});
+      Message msg(Type::DEPLOYED);
+      msg.set_int(Field::WORKER_ID, id_);
+      msg.set_int(Field::VARIANT_ID, model->id);
+      msg.set(Field::FREE_MEMORY, std::to_string(free_memory));
+      msg.set(Field::TOTAL_MEMORY, std::to_string(total_memory));
       outgoing_[0]->push(msg);
+      deployed = true;
       while (true)
       {
         try
         {
-          data = queue->pop();
-          if (data == 0)
+          data = queue->ring.pop();
+          if (data == 0 || queue->stopped.load())
           {
             spdlog::debug("⚠️ [worker] About to stop | Name: {}, batch-size: {}", model->name, model->batch_size);
             return;
           }
+          int batch_size = std::min(data, model->batch_size);
           startTime = chrono::high_resolution_clock::now();
-          module.forward({input});
+          module.forward({batch_size < model->batch_size ? input.narrow(0, 0, batch_size) : input});
           // std::this_thread::sleep_for(std::chrono::milliseconds(100)); // [TODO] Debug purpose.
           endTime = chrono::high_resolution_clock::now();
-          model->set_throughput(model->batch_size / std::chrono::duration_cast<std::chrono::duration<double>>(endTime - startTime).count());
+          model->record_throughput(batch_size / std::chrono::duration_cast<std::chrono::duration<double>>(endTime - startTime).count());
+          // Lets the controller track the work still in flight here, and
+          // how long a batch takes.
+          Message done(Type::COMPLETED);
+          done.set_int(Field::WORKER_ID, id_);
+          done.set_int(Field::VARIANT_ID, model->id);
+          done.set_int(Field::BATCH_SIZE, data);
+          done.set_int(Field::SERVICE_US, std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count());
+          outgoing_[0]->push(done);
           async_file->debug("{},{},{},{},{}",
                             std::chrono::system_clock::to_time_t(endTime),
                             id_,
                             model->id,
                             model->name,
-                            model->batch_size);
+                            batch_size);
           spdlog::debug("Inference: worker-id={}, id={}, name={}, thr={}",
                             id_,
                             model->id,
                             model->name,
-                            model->batch_size);
+                            batch_size);
         }
         catch (const std::exception &e)
         {
@@ -230,19 +227,149 @@ public:
     catch (const std::exception &e)
     {
       spdlog::error("⛔️ Error initializing model\n\t{}", e.what());
+      if (!deployed)
+      {
+        // The controller holds the memory for it until told.
+        retire(model->id);
+        Message failed(Type::DEPLOY_FAILED);
+        failed.set_int(Field::WORKER_ID, id_);
+        failed.set_int(Field::VARIANT_ID, model->id);
+        outgoing_[0]->push(failed);
+      }
     }
   }
 
 private:
+  using Handler = void (WorkerEngine::*)(const Message &);
+
+  void on_deploy(const Message &msg)
+  {
+    deployment_queue_.push(msg);
+    deployments_.trigger();
+  }
+
+  // Runs on the InPort drain, so it never waits: InPort hands the credit
+  // back as soon as this returns, the ring is not covered by the window.
+  void on_query(const Message &msg)
+  {
+    int variant_id = msg.get_int(Field::VARIANT_ID);
+    int batch_size = msg.get_int(Field::BATCH_SIZE);
+    std::shared_ptr<InferenceQueue> queue;
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      auto it = inference_queue_.find(variant_id);
+      if (it != inference_queue_.end())
+      {
+        queue = it->second;
+      }
+    }
+    // Number of queries of the batch, a partial batch runs fewer rows.
+    if (!queue || !queue->ring.try_push(std::max(1, batch_size))) // [TODO] push actual data.
+    {
+      reject(variant_id, batch_size);
+      return;
+    }
+    queue->received.fetch_add(batch_size, std::memory_order_relaxed);
+  }
+
+  // A batch that will not run (full ring or stopped variant) is counted and
+  // completed right away, so the controller does not keep it outstanding.
+  void reject(int variant_id, int batch_size)
+  {
+    rejected_.fetch_add(batch_size, std::memory_order_relaxed);
+    Message done(Type::COMPLETED);
+    done.set_int(Field::WORKER_ID, id_);
+    done.set_int(Field::VARIANT_ID, variant_id);
+    done.set_int(Field::BATCH_SIZE, batch_size);
+    outgoing_[0]->push(done);
+  }
+
+  // Retires the queue: later queries for the variant are rejected, and the
+  // inference thread stops at its next item even if the ring is full.
+  void on_stop(const Message &msg)
+  {
+    if (auto queue = retire(msg.get_int(Field::VARIANT_ID)))
+    {
+      queue->ring.try_push(0); // wakes it when idle
+    }
+  }
+
+  // The variant also stops being sampled, reported to the controller and
+  // listed in metrics(). Its queue, or nullptr if it was not running.
+  std::shared_ptr<InferenceQueue> retire(int variant_id)
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    auto it = inference_queue_.find(variant_id);
+    if (it == inference_queue_.end())
+    {
+      return nullptr;
+    }
+    std::shared_ptr<InferenceQueue> queue = std::move(it->second);
+    queue->stopped.store(true);
+    inference_queue_.erase(it);
+    running_variant_.erase(variant_id);
+    input_rate_.erase(variant_id);
+    incoming_stats_.erase(variant_id);
+    return queue;
+  }
+
+  void on_hello(const Message &msg)
+  {
+    spdlog::debug("👉[WORKER] Hello messge received: {}", msg.to_string());
+    id_ = msg.get_int(Field::WORKER_ID);
+    engine_name_ = "WorkerEngine-" + std::to_string(id_);
+    size_t free_memory;
+    size_t total_memory;
+    cudaMemGetInfo(&free_memory, &total_memory);
+    spdlog::debug("Total memory: {} MB | Free memory: {} MB", total_memory / (1024.0 * 1024), free_memory / (1024.0 * 1024));
+    total_mem_ = total_memory;
+    Message hello_msg(Type::HELLO);
+    hello_msg.set_int(Field::WORKER_ID, id_);
+    hello_msg.set(Field::TOTAL_MEM, std::to_string(total_mem_));
+    outgoing_[0]->push(hello_msg);
+
+    std::string logpath = config_["parameters"]["log_dir"].get<std::string>() + "_worker_" + std::to_string(id_) + ".csv";
+    // Create a logger
+    async_file = spdlog::basic_logger_mt<spdlog::async_factory>("async_file_logger", logpath, true);
+    // Set a custom format string
+    async_file->set_pattern("%v");
+    async_file->set_level(spdlog::level::debug);
+    async_file->debug("{},{},{},{},{}", "timestamp", "worker_id", "variant_id", "variant_name", "batch_size");
+  }
+
+  void ignore(const Message &msg) {}
+
+  // Indexed by Type, keep in the enum order.
+  static constexpr Handler HANDLERS[NUM_TYPES] = {
+      &WorkerEngine::on_query,  // QUERY
+      &WorkerEngine::on_hello,  // HELLO
+      &WorkerEngine::ignore,    // FINISHED
+      &WorkerEngine::ignore,    // REGISTER
+      &WorkerEngine::ignore,    // PROFILE_DATA
+      &WorkerEngine::ignore,    // DEPLOYED
+      &WorkerEngine::on_stop,   // STOP
+      &WorkerEngine::on_deploy, // DEPLOY
+      &WorkerEngine::ignore,    // CREDIT
+      &WorkerEngine::ignore,    // COMPLETED
+      &WorkerEngine::ignore,    // DEPLOY_FAILED
+  };
+
   Event event_;
   CSVWriter *csv_writter_;
   std::shared_ptr<spdlog::logger> async_file;
   // Queues and data
-  std::map<std::string, BlockingQueue<int> *> inference_queue_;
-  std::map<std::string, int> num_received_;
+  // stats_mutex_ guards the maps below and running_variant_: the deployment
+  // task inserts, the io thread looks up and erases, the monitors iterate.
+  std::map<int, std::shared_ptr<InferenceQueue>> inference_queue_;
+  std::atomic<uint64_t> rejected_{0}; // queries of the rejected batches
+  std::map<int, int> input_rate_; // received at the last sample, by variant id
+  std::map<int, WindowedStats> incoming_stats_; // per-second arrivals, by variant id
+  std::mutex stats_mutex_;
   BlockingQueue<Message> deployment_queue_;
+  SerialTask deployments_{task_pool_, [this]()
+                          { deployment_daemon(); }};
 
-  std::map<std::string, Model *> running_variant_;
+  std::map<int, Model *> running_variant_;
   std::vector<std::thread> inference_threads_;
   std::string hardware_platform_;
   torch::Device *device_;
@@ -0,0 +1,67 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <boost/asio.hpp>
+
+// Event loop shared by all the ports of an engine: a single io_service run
+// by a fixed number of threads, however many connections the engine has.
+class IoPool
+{
+public:
+  IoPool() {}
+
+  ~IoPool()
+  {
+    stop();
+  }
+
+  void start(size_t num_threads)
+  {
+    work_ = std::make_unique<boost::asio::io_service::work>(io_service_);
+    for (size_t i = 0; i < num_threads; i++)
+    {
+      threads_.emplace_back([this]()
+                            {
+        current() = this;
+        io_service_.run(); });
+    }
+  }
+
+  void stop()
+  {
+    work_.reset();
+    io_service_.stop();
+    for (auto &thread : threads_)
+    {
+      if (thread.joinable())
+      {
+        thread.join();
+      }
+    }
+    threads_.clear();
+  }
+
+  boost::asio::io_service &get_io_service() { return io_service_; }
+  size_t size() const { return threads_.size(); }
+
+  // True on the threads of this pool, which must never block waiting for
+  // work the loop itself has to do.
+  bool in_pool_thread() const { return current() == this; }
+
+private:
+  static const IoPool *&current()
+  {
+    static thread_local const IoPool *pool = nullptr;
+    return pool;
+  }
+
+  boost::asio::io_service io_service_;
+  std::unique_ptr<boost::asio::io_service::work> work_;
+  std::vector<std::thread> threads_;
+};
+
+#endif // IO_POOL_H
@@ -3,13 +3,21 @@
 #define MESSAGE_H
 
 #include <map>
+#include <array>
+#include <memory>
 #include <string>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <charconv>
+#include <stdexcept>
+#include <string_view>
 #include <nlohmann/json.hpp>
 
 using json = nlohmann::json;
 
-enum class Type
+enum class Type : uint8_t
 {
     QUERY,
     HELLO,
@@ -19,23 +27,219 @@ enum class Type
     DEPLOYED,
     STOP,
     DEPLOY,
+    CREDIT,    // flow control, InPort back to the sender
+    COMPLETED, // batch done, worker back to the controller
+    DEPLOY_FAILED, // the variant could not be loaded, worker back to the controller
 };
 
-struct MessageTypeInfo
+constexpr size_t NUM_TYPES = 11;
+
+const char *const TYPE_NAMES[NUM_TYPES] = {
+    "QUERY",
+    "HELLO",
+    "FINISHED",
+    "REGISTER",
+    "PROFILE_DATA",
+    "DEPLOYED",
+    "STOP",
+    "DEPLOY",
+    "CREDIT",
+    "COMPLETED",
+    "DEPLOY_FAILED",
+};
+
+const char *type2string(Type type)
+{
+    return TYPE_NAMES[static_cast<size_t>(type)];
+}
+
+Type string2type(std::string_view name)
+{
+    for (size_t i = 0; i < NUM_TYPES; i++)
+    {
+        if (name == TYPE_NAMES[i])
+            return static_cast<Type>(i);
+    }
+    throw std::invalid_argument("Unknown message type " + std::string(name));
+}
+
+// Interned message keys. Integer fields come first, they are stored natively
+// and map to the fixed slots of the binary encoding.
+enum class Field : uint8_t
 {
-    std::string name;
-    int value;
+    WORKER_ID,
+    VARIANT_ID,
+    BATCH_SIZE,
+    ID,
+    CREDITS,
+    SERVICE_US,
+    APP_ID,
+    NAME,
+    VARIANT_NAME,
+    TOTAL_MEM,
+    FREE_MEMORY,
+    TOTAL_MEMORY,
+    VARIANTS,
 };
 
-std::map<Type, std::string> type2string = {
-    {Type::QUERY, "QUERY"},
-    {Type::HELLO, "HELLO"},
-    {Type::FINISHED, "FINISHED"},
-    {Type::REGISTER, "REGISTER"},
-    {Type::PROFILE_DATA, "PROFILE_DATA"},
-    {Type::DEPLOYED, "DEPLOYED"},
-    {Type::STOP, "STOP"},
-    {Type::DEPLOY, "DEPLOY"},
+constexpr size_t NUM_INT_FIELDS = 6;
+constexpr size_t NUM_FIELDS = 13;
+
+const char *const FIELD_NAMES[NUM_FIELDS] = {
+    "worker_id",
+    "variant_id",
+    "batch_size",
+    "id",
+    "credits",
+    "service_us",
+    "app_id",
+    "name",
+    "variant_name",
+    "total_mem",
+    "free_memory",
+    "total_memory",
+    "variants",
+};
+
+constexpr bool is_int_field(Field field)
+{
+    return static_cast<size_t>(field) < NUM_INT_FIELDS;
+}
+
+bool string2field(std::string_view name, Field &field)
+{
+    for (size_t i = 0; i < NUM_FIELDS; i++)
+    {
+        if (name == FIELD_NAMES[i])
+        {
+            field = static_cast<Field>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Wire encoding spoken on a connection. Each OutPort picks one per remote
+// and sends it as text (JSON) or binary websocket frames, the InPort decodes
+// according to the frame opcode, so JSON stays available for debugging.
+enum class Encoding
+{
+    JSON,
+    BINARY,
+};
+
+Encoding string2encoding(const std::string &name)
+{
+    if (name == "json")
+        return Encoding::JSON;
+    if (name == "binary")
+        return Encoding::BINARY;
+    throw std::invalid_argument("Unknown encoding " + name);
+}
+
+// Binary layout (version 4, host byte order, little-endian on our targets):
+//
+//   u8  magic        0xA5
+//   u8  version      4
+//   u8  type         Type value
+//   u8  flags        bit i set when integer field i is present
+//   f64 timestamp
+//   i32 fixed[6]     worker_id, variant_id, batch_size, id, credits, service_us
+//   u16 field_mask   bit i set when string field NUM_INT_FIELDS + i is present
+//   per present string field { u32 len, bytes }
+//   u16 ext_count
+//   ext_count x { u16 key_len, key, u32 value_len, value }
+//
+// The extension area carries the free-form entries (e.g. REGISTER app names).
+//
+// Several messages coalesced into one frame use a batch envelope:
+//
+//   u8  magic        0xA6
+//   u8  version      1
+//   u16 count
+//   count x { u32 len, message }
+//
+// and a JSON array for the JSON encoding. A lone message is never wrapped.
+namespace wire
+{
+    constexpr uint8_t MAGIC = 0xA5;
+    constexpr uint8_t VERSION = 4;
+    constexpr uint8_t BATCH_MAGIC = 0xA6;
+    constexpr uint8_t BATCH_VERSION = 1;
+    constexpr size_t BATCH_HEADER_SIZE = 2 + sizeof(uint16_t);
+    constexpr size_t HEADER_SIZE = 4 + sizeof(double) + NUM_INT_FIELDS * sizeof(int32_t) + 2 * sizeof(uint16_t);
+
+    template <typename T>
+    void put(std::string &out, T value)
+    {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    T get(const char *&cursor, const char *end)
+    {
+        if (end - cursor < static_cast<std::ptrdiff_t>(sizeof(T)))
+            throw std::runtime_error("Truncated binary message");
+        T value;
+        std::memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+        return value;
+    }
+
+    std::string_view get_bytes(const char *&cursor, const char *end, size_t size)
+    {
+        if (static_cast<size_t>(end - cursor) < size)
+            throw std::runtime_error("Truncated binary message");
+        std::string_view bytes(cursor, size);
+        cursor += size;
+        return bytes;
+    }
+}
+
+// Field value with an inline buffer, only values longer than INLINE_SIZE
+// (e.g. the PROFILE_DATA json) go to the heap.
+class SmallValue
+{
+public:
+    static constexpr size_t INLINE_SIZE = 24;
+
+    SmallValue() {}
+    SmallValue(const SmallValue &other) { assign(other.view()); }
+    SmallValue(SmallValue &&other) = default;
+    SmallValue &operator=(SmallValue &&other) = default;
+
+    SmallValue &operator=(const SmallValue &other)
+    {
+        if (this != &other)
+            assign(other.view());
+        return *this;
+    }
+
+    void assign(std::string_view value)
+    {
+        size_ = value.size();
+        if (size_ <= INLINE_SIZE)
+        {
+            heap_.reset();
+            std::memcpy(inline_, value.data(), size_);
+        }
+        else
+        {
+            heap_ = std::make_unique<std::string>(value);
+        }
+    }
+
+    std::string_view view() const
+    {
+        if (heap_)
+            return *heap_;
+        return std::string_view(inline_, size_);
+    }
+
+private:
+    char inline_[INLINE_SIZE];
+    uint32_t size_ = 0;
+    std::unique_ptr<std::string> heap_;
 };
 
 class Message
@@ -43,58 +247,366 @@ class Message
 public:
     Message() {}
 
-    Message(const std::string &type)
+    Message(Type type)
         : type_(type) {}
 
-    Message(const std::string &type, const std::map<std::string, std::string> &data)
-        : type_(type), data_(data)
+    Message(Type type, double timestamp)
+        : timestamp_(timestamp), type_(type) {}
+
+    Message(Type type, const std::map<std::string, std::string> &data)
+        : type_(type)
     {
+        for (const auto &[key, value] : data)
+            append_data(key, value);
     }
 
-    Message(const float timestamp, const std::string &type, const std::map<std::string, std::string> &data)
-        : timestamp_(timestamp), type_(type), data_(data) {}
+    double getTimestamp() const { return timestamp_; }
+    Type getType() const { return type_; }
+    const char *type_name() const { return type2string(type_); }
 
-    float getTimestamp() const { return timestamp_; }
-    std::string getType() const { return type_; }
-    std::map<std::string, std::string> get_data() const { return data_; }
+    bool has(Field field) const { return present_ & (1u << static_cast<size_t>(field)); }
 
-    void append_data(std::string key, std::string value)
+    int get_int(Field field) const
     {
-        data_[key] = value;
+        check(field, true);
+        return ints_[static_cast<size_t>(field)];
+    }
+
+    std::string_view get(Field field) const
+    {
+        check(field, false);
+        return strings_[static_cast<size_t>(field) - NUM_INT_FIELDS].view();
+    }
+
+    double get_double(Field field) const
+    {
+        std::string_view value = get(field);
+        char buffer[64];
+        size_t size = std::min(value.size(), sizeof(buffer) - 1);
+        std::memcpy(buffer, value.data(), size);
+        buffer[size] = '\0';
+        return std::strtod(buffer, nullptr);
+    }
+
+    void set_int(Field field, int value)
+    {
+        if (!is_int_field(field))
+            throw std::invalid_argument(std::string("Not an integer field ") + FIELD_NAMES[static_cast<size_t>(field)]);
+        ints_[static_cast<size_t>(field)] = value;
+        present_ |= 1u << static_cast<size_t>(field);
+    }
+
+    void set(Field field, std::string_view value)
+    {
+        if (is_int_field(field))
+        {
+            int parsed = 0;
+            auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), parsed);
+            if (ec != std::errc() || end != value.data() + value.size())
+                throw std::invalid_argument(std::string("Not an integer value for ") + FIELD_NAMES[static_cast<size_t>(field)]);
+            set_int(field, parsed);
+            return;
+        }
+        strings_[static_cast<size_t>(field) - NUM_INT_FIELDS].assign(value);
+        present_ |= 1u << static_cast<size_t>(field);
+    }
+
+    // Free-form entries (keys that are not interned) land in extra_, which
+    // only allocates for the messages that use it (REGISTER).
+    void append_data(const std::string &key, const std::string &value)
+    {
+        Field field;
+        if (string2field(key, field))
+            set(field, value);
+        else
+            extra_[key] = value;
+    }
+
+    const std::map<std::string, std::string> &get_extra() const { return extra_; }
+
+    // Materialized view of every entry, for logging and the JSON encoding.
+    std::map<std::string, std::string> get_data() const
+    {
+        std::map<std::string, std::string> data = extra_;
+        for (size_t i = 0; i < NUM_FIELDS; i++)
+        {
+            Field field = static_cast<Field>(i);
+            if (!has(field))
+                continue;
+            if (is_int_field(field))
+                data[FIELD_NAMES[i]] = std::to_string(ints_[i]);
+            else
+                data[FIELD_NAMES[i]] = std::string(get(field));
+        }
+        return data;
     }
 
     std::string serialize() const
     {
         // convert to JSON: copy each value into the JSON object
-        json j = {{"timestamp", timestamp_}, {"type", type_}, {"data", data_}};
+        json j = {{"timestamp", timestamp_}, {"type", type_name()}, {"data", get_data()}};
         return j.dump();
     }
-    
+
     void deserialize(const std::string &s)
     {
-        auto j = json::parse(s);
-        
+        deserialize(s.data(), s.size());
+    }
+
+    void deserialize(const char *data, size_t size)
+    {
+        from_json(json::parse(data, data + size));
+    }
+
+    void from_json(const json &j)
+    {
         // convert from JSON: copy each value from the JSON object
-        data_       = j["data"].get<std::map<std::string, std::string>>();
-        type_       = j["type"].get<std::string>();
-        timestamp_  = j["timestamp"].get<float>();
+        clear();
+        for (const auto &[key, value] : j["data"].items())
+            append_data(key, value.get<std::string>());
+        type_       = string2type(j["type"].get<std::string>());
+        timestamp_  = j["timestamp"].get<double>();
+    }
+
+    void serialize_binary(std::string &out) const
+    {
+        out.clear();
+        append_binary(out);
+    }
+
+    void append_binary(std::string &out) const
+    {
+        out.reserve(out.size() + wire::HEADER_SIZE + 32 * (NUM_FIELDS - NUM_INT_FIELDS + extra_.size()));
+
+        uint16_t field_mask = present_ >> NUM_INT_FIELDS;
+        wire::put<uint8_t>(out, wire::MAGIC);
+        wire::put<uint8_t>(out, wire::VERSION);
+        wire::put<uint8_t>(out, static_cast<uint8_t>(type_));
+        wire::put<uint8_t>(out, present_ & ((1u << NUM_INT_FIELDS) - 1));
+        wire::put<double>(out, timestamp_);
+        for (size_t i = 0; i < NUM_INT_FIELDS; i++)
+            wire::put<int32_t>(out, ints_[i]);
+        wire::put<uint16_t>(out, field_mask);
+        for (size_t i = NUM_INT_FIELDS; i < NUM_FIELDS; i++)
+        {
+            if (!has(static_cast<Field>(i)))
+                continue;
+            std::string_view value = strings_[i - NUM_INT_FIELDS].view();
+            wire::put<uint32_t>(out, value.size());
+            out.append(value.data(), value.size());
+        }
+        wire::put<uint16_t>(out, extra_.size());
+        for (const auto &[key, value] : extra_)
+        {
+            wire::put<uint16_t>(out, key.size());
+            out.append(key);
+            wire::put<uint32_t>(out, value.size());
+            out.append(value);
+        }
+    }
+
+    std::string serialize_binary() const
+    {
+        std::string out;
+        serialize_binary(out);
+        return out;
+    }
+
+    void deserialize_binary(const char *data, size_t size)
+    {
+        const char *cursor = data;
+        const char *end = data + size;
+        if (wire::get<uint8_t>(cursor, end) != wire::MAGIC)
+            throw std::runtime_error("Bad binary message magic");
+        uint8_t version = wire::get<uint8_t>(cursor, end);
+        if (version != wire::VERSION)
+            throw std::runtime_error("Unsupported binary message version " + std::to_string(version));
+
+        uint8_t type = wire::get<uint8_t>(cursor, end);
+        if (type >= NUM_TYPES)
+            throw std::runtime_error("Unknown binary message type");
+        clear();
+        type_ = static_cast<Type>(type);
+
+        present_ = wire::get<uint8_t>(cursor, end) & ((1u << NUM_INT_FIELDS) - 1);
+        timestamp_ = wire::get<double>(cursor, end);
+        for (size_t i = 0; i < NUM_INT_FIELDS; i++)
+            ints_[i] = wire::get<int32_t>(cursor, end);
+
+        uint16_t field_mask = wire::get<uint16_t>(cursor, end);
+        for (size_t i = NUM_INT_FIELDS; i < NUM_FIELDS; i++)
+        {
+            if (!(field_mask & (1u << (i - NUM_INT_FIELDS))))
+                continue;
+            uint32_t len = wire::get<uint32_t>(cursor, end);
+            set(static_cast<Field>(i), wire::get_bytes(cursor, end, len));
+        }
+
+        uint16_t ext_count = wire::get<uint16_t>(cursor, end);
+        for (uint16_t i = 0; i < ext_count; i++)
+        {
+            uint16_t key_len = wire::get<uint16_t>(cursor, end);
+            std::string key(wire::get_bytes(cursor, end, key_len));
+            uint32_t value_len = wire::get<uint32_t>(cursor, end);
+            extra_[key] = std::string(wire::get_bytes(cursor, end, value_len));
+        }
+    }
+
+    void deserialize(const char *data, size_t size, Encoding encoding)
+    {
+        if (encoding == Encoding::BINARY)
+            deserialize_binary(data, size);
+        else
+            deserialize(data, size);
     }
 
     std::string to_string() const
     {
         std::string data_format = "[";
-        for (const auto &[key, value]: data_)
+        for (const auto &[key, value]: get_data())
             data_format += "'" + key + "': " + value + ", ";
         data_format += "]";
         return "Message('timestamp': " + std::to_string(timestamp_) +
-               ", 'type': " + type_ +
+               ", 'type': " + type_name() +
                ", 'data': " + data_format + ")";
     }
 
 private:
-    float timestamp_ = 0.0;
-    std::string type_;
-    std::map<std::string, std::string> data_;
+    void check(Field field, bool want_int) const
+    {
+        if (is_int_field(field) != want_int)
+            throw std::invalid_argument(std::string("Wrong accessor for field ") + FIELD_NAMES[static_cast<size_t>(field)]);
+        if (!has(field))
+            throw std::out_of_range(std::string("Missing field ") + FIELD_NAMES[static_cast<size_t>(field)] + " in " + type_name());
+    }
+
+    void clear()
+    {
+        present_ = 0;
+        extra_.clear();
+    }
+
+    double timestamp_ = 0.0;
+    Type type_ = Type::HELLO;
+    uint16_t present_ = 0;
+    int32_t ints_[NUM_INT_FIELDS] = {};
+    std::array<SmallValue, NUM_FIELDS - NUM_INT_FIELDS> strings_;
+    std::map<std::string, std::string> extra_;
+};
+
+// Coalesces the messages of one send into a single frame.
+class BatchWriter
+{
+public:
+    BatchWriter(Encoding encoding) : encoding_(encoding) { clear(); }
+
+    void clear()
+    {
+        count_ = 0;
+        buffer_.clear();
+        if (encoding_ == Encoding::BINARY)
+            buffer_.append(wire::BATCH_HEADER_SIZE, '\0');
+        else
+            buffer_.push_back('[');
+    }
+
+    void add(const Message &msg)
+    {
+        if (encoding_ == Encoding::BINARY)
+        {
+            size_t offset = buffer_.size();
+            wire::put<uint32_t>(buffer_, 0);
+            msg.append_binary(buffer_);
+            uint32_t len = buffer_.size() - offset - sizeof(uint32_t);
+            std::memcpy(&buffer_[offset], &len, sizeof(len));
+        }
+        else
+        {
+            if (count_ > 0)
+                buffer_.push_back(',');
+            buffer_.append(msg.serialize());
+        }
+        count_++;
+    }
+
+    size_t count() const { return count_; }
+    size_t bytes() const { return buffer_.size(); }
+    bool full() const { return count_ == UINT16_MAX; }
+
+    // Frame payload, valid until the next clear()/add().
+    std::string_view finish()
+    {
+        if (encoding_ == Encoding::BINARY)
+        {
+            if (count_ == 1)
+                return std::string_view(buffer_).substr(wire::BATCH_HEADER_SIZE + sizeof(uint32_t));
+            uint16_t count = count_;
+            buffer_[0] = static_cast<char>(wire::BATCH_MAGIC);
+            buffer_[1] = static_cast<char>(wire::BATCH_VERSION);
+            std::memcpy(&buffer_[2], &count, sizeof(count));
+            return buffer_;
+        }
+        if (count_ == 1)
+            return std::string_view(buffer_).substr(1);
+        buffer_.push_back(']');
+        return buffer_;
+    }
+
+    // Finished frame moved out, for transports that queue it; clear() before reuse.
+    std::string release()
+    {
+        std::string_view frame = finish();
+        if (frame.size() != buffer_.size())
+            return std::string(frame);
+        return std::move(buffer_);
+    }
+
+private:
+    Encoding encoding_;
+    size_t count_ = 0;
+    std::string buffer_;
 };
 
-#endif // MESSAGE_H
\ No newline at end of file
+// Decode a received frame, batched or not, calling on_message per message.
+template <typename Callback>
+void unpack_frame(const char *data, size_t size, Encoding encoding, Callback &&on_message)
+{
+    Message message;
+    if (encoding == Encoding::BINARY)
+    {
+        if (size == 0 || static_cast<uint8_t>(data[0]) != wire::BATCH_MAGIC)
+        {
+            message.deserialize_binary(data, size);
+            on_message(message);
+            return;
+        }
+        const char *cursor = data + 1;
+        const char *end = data + size;
+        if (wire::get<uint8_t>(cursor, end) != wire::BATCH_VERSION)
+            throw std::runtime_error("Unsupported batch version");
+        uint16_t count = wire::get<uint16_t>(cursor, end);
+        for (uint16_t i = 0; i < count; i++)
+        {
+            uint32_t len = wire::get<uint32_t>(cursor, end);
+            std::string_view bytes = wire::get_bytes(cursor, end, len);
+            message.deserialize_binary(bytes.data(), bytes.size());
+            on_message(message);
+        }
+        return;
+    }
+
+    json j = json::parse(data, data + size);
+    if (!j.is_array())
+    {
+        message.from_json(j);
+        on_message(message);
+        return;
+    }
+    for (const auto &item : j)
+    {
+        message.from_json(item);
+        on_message(message);
+    }
+}
+
+#endif // MESSAGE_H
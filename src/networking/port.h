@@ -2,77 +2,63 @@
 #define PORT_H
 
 #include <string>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
 #include <thread>
-#include <websocketpp/server.hpp>
-#include <websocketpp/client.hpp>
-#include <websocketpp/config/asio_no_tls.hpp>
+#include <iterator>
+#include <algorithm>
+#include <functional>
 #include "utils/queue.h"
 #include "message.h"
-
-typedef websocketpp::client<websocketpp::config::asio> client;
-typedef websocketpp::server<websocketpp::config::asio> server;
+#include "transport.h"
+#include "io_pool.h"
 
 using namespace std;
 
+// Frames are decoded on the engine's io loop. At most one drain task runs
+// at a time, so callbacks stay serialized and in arrival order. Every
+// message handed to the callback earns its sender one credit back, which
+// bounds the depth for senders with a credit window. The queue itself is
+// unbounded: it is pushed from the io threads, which must never wait on a
+// drain that runs on the same loop.
 class InPort
 {
 public:
-  InPort(const std::string &host, int port, std::function<void(const Message &)> callback)
-      : host_(host), port_(port), callback_(callback), server_()
+  InPort(IoPool &io_pool, const std::string &host, int port, std::function<void(const Message &)> callback, TransportKind transport = TransportKind::WS)
+      : io_service_(io_pool.get_io_service()), host_(host), port_(port), callback_(callback)
   {
     try
     {
-      spdlog::debug("[InPort] Host: {}, Port: {}" + host, port);
-      // Set logging settings
-      server_.get_alog().set_channels(websocketpp::log::alevel::none);
-
-      // Initialize Asio
-      server_.init_asio();
-
-      // Handle WebSocket connections
-      server_.set_open_handler([this](websocketpp::connection_hdl hdl)
-                               { spdlog::debug("[InPort] Client connected."); });
-
-      server_.set_close_handler([this](websocketpp::connection_hdl hdl)
-                                { spdlog::debug("👋🏻[InPort] Server disconnected."); });
-      server_.set_fail_handler([this](websocketpp::connection_hdl)
-                               {
-            connected_ = false;
-            spdlog::error("⛔️[InPort] Connection failed to host {} and port {}" ,host_ ,port_); });
-      server_.set_message_handler([this](websocketpp::connection_hdl hdl, server::message_ptr msg)
-                                  { message_queue_.push(msg->get_payload()); });
-
-      server_.set_open_handler([this](websocketpp::connection_hdl)
-                               { connected_ = true; });
-
-      server_.listen(port);
-      // Start the server accept loop
-      server_.start_accept();
-
-      server_thread_ = std::thread([this]()
-                                   { server_.run(); });
-
-      consumer_thread_ = std::thread(&InPort::run, this);
+      spdlog::debug("[InPort] Host: {}, Port: {}", host, port);
+      transport_ = make_server_transport(transport, io_service_, host, port);
+      transport_->start([this](Frame &&frame)
+                        {
+        message_queue_.push(std::move(frame));
+        if (!draining_.exchange(true))
+        {
+          io_service_.post([this]()
+                           { drain(); });
+        } });
     }
     catch (const std::exception &e)
     {
-      spdlog::error("⛔️[InPort] Error while trying to set input connection at host: {}, and port: {}", host_, port_, e.what());
+      spdlog::error("⛔️[InPort] Error while trying to set input connection at host: {}, and port: {}\n\t{}", host_, port_, e.what());
     }
   }
 
   ~InPort()
   {
-    server_.stop();
-    message_queue_.push(""); // Empty string signals shutdown
-    if (consumer_thread_.joinable())
+    if (transport_)
     {
-      consumer_thread_.join();
+      transport_->stop();
     }
-    if (server_thread_.joinable())
+    while (draining_)
     {
-      server_thread_.join();
+      std::this_thread::yield();
     }
   }
 
@@ -83,127 +69,233 @@ public:
            ", 'qsize': " + std::to_string(message_queue_.size()) + ")";
   }
 
+  json metrics() const
+  {
+    return {{"port", port_},
+            {"queued_frames", message_queue_.size()},
+            {"received", received_.load(std::memory_order_relaxed)}};
+  }
+
   std::string get_host() const { return host_; }
   int get_port() const { return port_; }
 
 private:
-  void run()
+  void drain()
   {
-    std::string data;
-    while (true)
+    Frame frame;
+    while (message_queue_.try_pop(frame))
     {
-      data = message_queue_.pop();
-      if (data.empty())
+      size_t count = 0;
+      try
       {
-        break;
+        unpack_frame(frame.data, frame.size, frame.encoding, [this, &count](const Message &message)
+                     {
+          callback_(message);
+          count++; });
+      }
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️[InPort] Dropping malformed message\n\t{}", e.what());
       }
-      Message message;
-      message.deserialize(data);
-      callback_(message);
+      received_.fetch_add(count, std::memory_order_relaxed);
+      grant(frame.peer, count);
+      frame = Frame(); // Releases the buffer (or ring space) right away
+    }
+    send_credits();
+    draining_ = false;
+    // A frame pushed after the last try_pop but before the flag was cleared:
+    // its push holds the queue's lock before the sender checks the flag.
+    if (message_queue_.size() > 0 && !draining_.exchange(true))
+    {
+      io_service_.post([this]()
+                       { drain(); });
+    }
+  }
+
+  // Credits of consecutive frames from the same sender go back together.
+  void grant(const std::shared_ptr<Peer> &peer, size_t count)
+  {
+    if (peer != credit_peer_ || credit_count_ >= CREDIT_BATCH)
+    {
+      send_credits();
+      credit_peer_ = peer;
+    }
+    credit_count_ += count;
+  }
+
+  void send_credits()
+  {
+    if (credit_peer_ && credit_count_ > 0)
+    {
+      Message credit(Type::CREDIT);
+      credit.set_int(Field::CREDITS, credit_count_);
+      credit_peer_->send(credit.serialize_binary(), Encoding::BINARY);
     }
+    credit_peer_.reset();
+    credit_count_ = 0;
   }
 
-  server server_;
+  static constexpr size_t CREDIT_BATCH = 256;
+
+  boost::asio::io_service &io_service_;
   std::string host_;
   int port_;
-  bool connected_;
-  std::function<void(Message)> callback_;
-  BlockingQueue<std::string> message_queue_;
-  std::thread server_thread_;
-  std::thread consumer_thread_;
+  std::function<void(const Message &)> callback_;
+  std::unique_ptr<ServerTransport> transport_;
+  BlockingQueue<Frame> message_queue_; // unbounded, drained by one task
+  std::atomic<bool> draining_{false};
+  std::atomic<size_t> received_{0};
+  std::shared_ptr<Peer> credit_peer_; // drain only
+  size_t credit_count_ = 0;           // drain only
+};
+
+// Per-remote settings, read from the "remote_engines" entries of the config.
+struct OutPortOptions
+{
+  TransportKind transport = TransportKind::WS;
+  Encoding encoding = Encoding::BINARY;
+  // How long a send may wait for more messages to coalesce into the same
+  // frame. Zero only coalesces what is already queued.
+  std::chrono::microseconds max_coalescing_delay{0};
+  size_t max_batch_bytes = 64 * 1024;
+  // Ring size of the shm transport, a power of two.
+  size_t shm_ring_bytes = 1 << 22;
+  // Bound of the send queue in messages (0 for unbounded) and what push()
+  // does when it is full. Threads of the io loop never block, they queue
+  // past the bound instead; they should use try_push() to stay bounded.
+  size_t queue_capacity = 1 << 16;
+  OverflowPolicy overflow = OverflowPolicy::BLOCK;
+  // Messages in flight the remote InPort has not consumed yet; it returns
+  // CREDIT messages as it does. 0 disables flow control.
+  size_t credit_window = 4096;
+
+  static OutPortOptions from_json(const json &remote)
+  {
+    OutPortOptions options;
+    options.transport = string2transport(remote.value("transport", "ws"));
+    options.encoding = string2encoding(remote.value("encoding", "binary"));
+    options.max_coalescing_delay = std::chrono::microseconds(remote.value("max_coalescing_delay_us", 0));
+    options.max_batch_bytes = remote.value("max_batch_bytes", options.max_batch_bytes);
+    options.shm_ring_bytes = remote.value("shm_ring_bytes", options.shm_ring_bytes);
+    options.queue_capacity = remote.value("queue_capacity", options.queue_capacity);
+    options.overflow = string2overflow(remote.value("overflow_policy", "block"));
+    options.credit_window = remote.value("credit_window", options.credit_window);
+    return options;
+  }
 };
 
+// Pushes only queue the message; a flush task on the io loop encodes what
+// is pending into frames and hands them to the transport, whose writes are
+// chained asynchronously. No thread per connection. With flow control the
+// flush stops when the credits run out and resumes on the next CREDIT, so
+// a slow remote fills the bounded queue here instead of its own memory.
 class OutPort
 {
 public:
-  OutPort(int id, const std::string &remote_host, int remote_port)
-      : id_(id), remote_host_(remote_host), remote_port_(remote_port),
-        client_()
+  OutPort(IoPool &io_pool, int id, const std::string &remote_host, int remote_port, const OutPortOptions &options = OutPortOptions())
+      : io_pool_(io_pool), io_service_(io_pool.get_io_service()), remote_host_(remote_host), remote_port_(remote_port), id_(id), options_(options),
+        batch_(options.encoding), flush_timer_(io_service_), credits_(options.credit_window)
   {
-    spdlog::debug("[OutPort] Host: {}, Port: {}", remote_host, remote_port);
-
-    // Set logging to be pretty verbose (everything except message payloads)
-    client_.get_alog().set_channels(websocketpp::log::alevel::none);
-
-    // ex. "ws://localhost:9002"
-    url_ = "ws://" + remote_host + ":" + std::to_string(remote_port);
+    spdlog::debug("[OutPort] Host: {}, Port: {}, Encoding: {}", remote_host, remote_port, options.encoding == Encoding::BINARY ? "binary" : "json");
 
-    // Initialize ASIO
-    client_.init_asio();
-    client_.set_open_handler([this](websocketpp::connection_hdl hdl)
-                             {
-        this->hdl_ = hdl;
-        connected_ = true;
-        runner_thread_ = std::thread(&OutPort::run, this);
-        spdlog::debug("✅[OutPort] Connected successfully!"); });
-    // Handle WebSocket connections
-
-    client_.set_close_handler([&](websocketpp::connection_hdl hdl)
-                              { spdlog::debug("👋🏻[OutPort] Client disconnected."); });
-
-    client_.set_message_handler([this](websocketpp::connection_hdl hdl, client::message_ptr msg)
-                                {
-                                  Message message(msg->get_payload());
-                                  spdlog::debug("[OutPort] Received message: {}", message.to_string());
-                                  // Handle message
-                                });
-    client_.set_fail_handler([this](websocketpp::connection_hdl)
-                             {
-            connected_ = false;
-            spdlog::error("⛔️[OutPort] Connection failed to host {} and port {}\n\tRetrying...", remote_host_ ,remote_port_);
-            schedule_retry(); });
-
-    connect();
-
-    // Start the ASIO io_service run loop
-    // this will cause a single connection to be made to the server.
-    client_thread_ = std::thread([this]()
-                                 { client_.run(); });
+    if (options_.transport == TransportKind::SHM)
+    {
+      // A batch may overshoot the budget by one message, keep it well inside the ring.
+      options_.max_batch_bytes = std::min(options_.max_batch_bytes, options_.shm_ring_bytes / 4);
+    }
+    transport_ = make_client_transport(options.transport, io_service_, remote_host, remote_port, options.shm_ring_bytes);
+    transport_->start([this]()
+                      {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        connected_ = true;
+                        // A new connection: credits of frames lost with the
+                        // previous one never come back.
+                        credits_ = options_.credit_window;
+                        schedule_flush();
+                      },
+                      [this](Frame &&frame)
+                      {
+                        try
+                        {
+                          unpack_frame(frame.data, frame.size, frame.encoding, [this](const Message &message)
+                                       {
+                            if (message.getType() == Type::CREDIT)
+                            {
+                              std::lock_guard<std::mutex> lock(mutex_);
+                              credits_ += message.get_int(Field::CREDITS);
+                              schedule_flush();
+                              return;
+                            }
+                            spdlog::debug("[OutPort] Received message: {}", message.to_string()); });
+                        }
+                        catch (const std::exception &e)
+                        {
+                          spdlog::error("⛔️[OutPort] Dropping malformed message\n\t{}", e.what());
+                        }
+                      });
   }
 
   ~OutPort()
   {
-    Message message("FINISHED");
-    message_queue_.push(message); // Empty string signals shutdown
-    client_.stop();
-    if (runner_thread_.joinable())
     {
-      runner_thread_.join();
-    }
-    if (client_thread_.joinable())
-    {
-      client_thread_.join();
+      std::unique_lock<std::mutex> lock(mutex_);
+      pending_.push_back(Message(Type::FINISHED)); // FINISHED signals shutdown, past the bound
+      schedule_flush();
+      // Give the loop a moment to write the tail out.
+      flushed_.wait_for(lock, std::chrono::seconds(1), [this]()
+                        { return pending_.empty() && !flush_scheduled_; });
+      flush_timer_.cancel();
     }
+    spdlog::debug("[OutPort] Closing the connection to {}:{}", remote_host_, remote_port_);
+    transport_->stop();
   }
 
-  void connect()
+  // False when the message was rejected by a full queue.
+  bool push(const Message &msg)
   {
-    websocketpp::lib::error_code ec;
-    client::connection_ptr con = client_.get_connection(url_, ec);
-    if (ec)
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (options_.queue_capacity > 0 && pending_.size() >= options_.queue_capacity)
     {
-      spdlog::error("Could not create connection: {}", ec.message());
-      return;
+      switch (options_.overflow)
+      {
+      case OverflowPolicy::BLOCK:
+        if (!io_pool_.in_pool_thread())
+        {
+          space_.wait(lock, [this]()
+                      { return pending_.size() < options_.queue_capacity; });
+        }
+        break;
+      case OverflowPolicy::DROP_OLDEST:
+        pending_.pop_front();
+        dropped_++;
+        break;
+      default:
+        dropped_++;
+        return false;
+      }
     }
-    client_.connect(con);
+    pending_.push_back(msg);
+    schedule_flush();
+    return true;
   }
 
-  void schedule_retry()
+  // Never waits, whatever the policy: false when the queue is full, and the
+  // message is not queued. on_space then runs once, on the flush thread, as
+  // soon as there is room again.
+  bool try_push(const Message &msg, std::function<void()> on_space = nullptr)
   {
-    if (retry_count_ >= max_retries_)
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (options_.queue_capacity > 0 && pending_.size() >= options_.queue_capacity)
     {
-      spdlog::error("⛔️ Max retries reached. Giving up.");
-      return;
+      if (on_space)
+      {
+        space_waiters_.push_back(std::move(on_space));
+      }
+      return false;
     }
-    retry_count_++;
-    std::this_thread::sleep_for(std::chrono::seconds(3));
-
-    connect();
-  }
-
-  void push(const Message &msg)
-  {
-    message_queue_.push(msg);
+    pending_.push_back(msg);
+    schedule_flush();
+    return true;
   }
 
   std::string getRemoteHost()
@@ -221,49 +313,146 @@ public:
 
   std::string to_string() const
   {
+    std::lock_guard<std::mutex> lock(mutex_);
     return "OutPort('remote host': " + remote_host_ +
            ", 'remote port': " + std::to_string(remote_port_) +
-           ", 'qsize': " + std::to_string(message_queue_.size()) + ")";
+           ", 'qsize': " + std::to_string(pending_.size()) +
+           ", 'dropped': " + std::to_string(dropped_) + ")";
+  }
+
+  json metrics() const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {{"remote_host", remote_host_},
+            {"remote_port", remote_port_},
+            {"queued", pending_.size()},
+            {"dropped", dropped_},
+            {"credits", credits_}};
   }
 
 private:
-  void run()
+  // Called with mutex_ held. The first pending message arms the flush: right
+  // away, or after the coalescing delay so later pushes join the same frame.
+  void schedule_flush()
   {
-    while (!connected_)
+    if (!connected_ || flush_scheduled_ || pending_.empty() || (options_.credit_window > 0 && credits_ == 0))
+    {
+      return;
+    }
+    flush_scheduled_ = true;
+    if (options_.max_coalescing_delay.count() > 0)
     {
-      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      flush_timer_.expires_from_now(options_.max_coalescing_delay);
+      flush_timer_.async_wait([this](const boost::system::error_code &ec)
+                              {
+        if (ec != boost::asio::error::operation_aborted)
+          flush(); });
     }
-    try
+    else
+    {
+      io_service_.post([this]()
+                       { flush(); });
+    }
+  }
+
+  // Only one flush is scheduled at a time, it keeps going until nothing is
+  // pending (or no credit is left) so the order of pushes is the order on
+  // the wire.
+  void flush()
+  {
+    while (true)
     {
-      while (true)
+      std::vector<std::function<void()>> waiters;
       {
-        Message message = message_queue_.pop();
-        client_.send(hdl_, message.serialize(), websocketpp::frame::opcode::text);
-        if (message.getType() == "FINISHED")
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t count = pending_.size();
+        if (options_.credit_window > 0)
         {
-          cout << "--- Will close connection---" << endl;
-          break;
+          count = std::min(count, credits_);
+          credits_ -= count;
         }
+        if (count == 0)
+        {
+          flush_scheduled_ = false;
+          flushed_.notify_all();
+          return;
+        }
+        if (count == pending_.size())
+        {
+          sending_.swap(pending_);
+        }
+        else
+        {
+          std::move(pending_.begin(), pending_.begin() + count, std::back_inserter(sending_));
+          pending_.erase(pending_.begin(), pending_.begin() + count);
+        }
+        waiters.swap(space_waiters_);
       }
+      space_.notify_all();
+      for (auto &waiter : waiters)
+      {
+        waiter();
+      }
+      size_t sent = 0; // messages of the frames the transport took
+      try
+      {
+        batch_.clear();
+        for (const auto &message : sending_)
+        {
+          batch_.add(message);
+          if (batch_.full() || batch_.bytes() >= options_.max_batch_bytes)
+          {
+            sent += send_batch();
+          }
+        }
+        if (batch_.count() > 0)
+        {
+          sent += send_batch();
+        }
+      }
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️ Connection lost\n\t{}", e.what());
+      }
+      // No credit comes back for a dropped frame, its messages get theirs
+      // back here or the window would shrink for good.
+      if (options_.credit_window > 0 && sent < sending_.size())
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        credits_ = std::min(credits_ + (sending_.size() - sent), options_.credit_window);
+      }
+      sending_.clear();
     }
-    catch (const std::exception &e)
-    {
-      spdlog::error("⛔️ Connection lost\n\t{}", e.what());
-    }
   }
 
+  // Flush only: the messages of the batch if the transport took it, else 0.
+  size_t send_batch()
+  {
+    size_t count = batch_.count();
+    bool sent = transport_->send(batch_.release(), options_.encoding);
+    batch_.clear();
+    return sent ? count : 0;
+  }
+
+  IoPool &io_pool_;
+  boost::asio::io_service &io_service_;
   std::string remote_host_;
   int remote_port_;
   int id_;
-  std::string url_;
-  client client_;
-  bool connected_;
-  BlockingQueue<Message> message_queue_; // Not thread-safe!  std::mutex queue_mutex_;
-  websocketpp::connection_hdl hdl_;
-  std::thread client_thread_;
-  std::thread runner_thread_;
-  int retry_count_;
-  const int max_retries_ = 20;
+  OutPortOptions options_;
+  std::unique_ptr<ClientTransport> transport_;
+  mutable std::mutex mutex_;
+  std::condition_variable flushed_;
+  std::condition_variable space_;
+  std::vector<std::function<void()>> space_waiters_; // try_push() callers
+  std::deque<Message> pending_;
+  std::deque<Message> sending_; // flush only
+  BatchWriter batch_;           // flush only
+  boost::asio::steady_timer flush_timer_;
+  bool connected_ = false;
+  bool flush_scheduled_ = false;
+  size_t credits_;
+  size_t dropped_ = 0;
 };
 
-#endif // PORT_H
\ No newline at end of file
+#endif // PORT_H
@@ -0,0 +1,271 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+// Control block at the start of the shared mapping. Producer and consumer
+// indices sit on their own cache lines, they only ever grow (positions are
+// taken modulo the capacity).
+struct ShmRingHeader
+{
+  alignas(64) std::atomic<uint64_t> head; // released by the consumer
+  alignas(64) std::atomic<uint64_t> tail; // published by the producer
+  alignas(64) std::atomic<uint32_t> consumer_waiting;
+  alignas(64) std::atomic<uint32_t> producer_waiting;
+  std::atomic<uint32_t> closed;
+  uint64_t capacity;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared ring needs lock-free 64-bit atomics");
+
+// Single-producer/single-consumer byte ring in a memfd mapping, shared by
+// two processes. Records are { u32 len, u8 tag, pad, payload } aligned on 8
+// bytes; a record that does not fit before the end of the buffer is preceded
+// by a wrap marker. Both sides spin briefly before parking on an eventfd, and
+// only signal the eventfd when the other side announced it is parked.
+class ShmRing
+{
+public:
+  struct Record
+  {
+    const char *data;
+    uint32_t size;
+    uint8_t tag;
+    uint64_t end;
+  };
+
+  // Producer side: allocates the memfd and the two eventfds.
+  static std::unique_ptr<ShmRing> create(size_t capacity)
+  {
+    if (capacity < 4096 || (capacity & (capacity - 1)) != 0)
+      throw std::invalid_argument("Ring capacity must be a power of two >= 4096");
+    int memfd = ::memfd_create("roomie-ring", MFD_CLOEXEC);
+    if (memfd < 0 || ::ftruncate(memfd, HEADER_BYTES + capacity) < 0)
+      throw std::runtime_error("Could not allocate shared ring: " + std::string(strerror(errno)));
+    auto ring = std::unique_ptr<ShmRing>(new ShmRing(memfd, ::eventfd(0, EFD_CLOEXEC), ::eventfd(0, EFD_CLOEXEC)));
+    new (ring->header_) ShmRingHeader();
+    ring->header_->capacity = capacity;
+    ring->capacity_ = capacity;
+    return ring;
+  }
+
+  // Consumer side: maps the descriptors received from the producer.
+  static std::unique_ptr<ShmRing> attach(int memfd, int data_fd, int space_fd)
+  {
+    auto ring = std::unique_ptr<ShmRing>(new ShmRing(memfd, data_fd, space_fd));
+    ring->capacity_ = ring->header_->capacity;
+    return ring;
+  }
+
+  ~ShmRing()
+  {
+    ::munmap(base_, HEADER_BYTES + capacity_);
+    ::close(memfd_);
+    ::close(data_fd_);
+    ::close(space_fd_);
+  }
+
+  int memfd() const { return memfd_; }
+  int data_fd() const { return data_fd_; }
+  int space_fd() const { return space_fd_; }
+
+  // Producer: copy one record in, blocking while the ring is full.
+  void write(std::string_view payload, uint8_t tag)
+  {
+    size_t record = RECORD_HEADER + align(payload.size());
+    if (record > capacity_ / 2)
+      throw std::runtime_error("Frame of " + std::to_string(payload.size()) + " bytes exceeds the shared ring");
+
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    size_t offset = tail & (capacity_ - 1);
+    size_t till_end = capacity_ - offset;
+    wait_for_space(tail, record <= till_end ? record : till_end + record);
+
+    if (record > till_end)
+    {
+      put_header(offset, WRAP, 0);
+      tail += till_end;
+      offset = 0;
+    }
+    put_header(offset, payload.size(), tag);
+    std::memcpy(data_ + offset + RECORD_HEADER, payload.data(), payload.size());
+    header_->tail.store(tail + record, std::memory_order_release);
+    wake(header_->consumer_waiting, data_fd_);
+  }
+
+  // Consumer: next record, read in place. Blocks until one is available,
+  // false once the ring is closed and drained.
+  bool read(Record &out)
+  {
+    while (!try_read(out))
+    {
+      if (!wait_for_data())
+        return false;
+    }
+    return true;
+  }
+
+  // Consumer, non-blocking: false when no record is available right now.
+  bool try_read(Record &out)
+  {
+    while (header_->tail.load(std::memory_order_acquire) != read_pos_)
+    {
+      size_t offset = read_pos_ & (capacity_ - 1);
+      uint32_t len;
+      std::memcpy(&len, data_ + offset, sizeof(len));
+      if (len == WRAP)
+      {
+        read_pos_ += capacity_ - offset;
+        continue;
+      }
+      out.data = data_ + offset + RECORD_HEADER;
+      out.size = len;
+      out.tag = static_cast<uint8_t>(data_[offset + sizeof(len)]);
+      read_pos_ += RECORD_HEADER + align(len);
+      out.end = read_pos_;
+      return true;
+    }
+    return false;
+  }
+
+  // Consumer: announce we are about to wait on data_fd() (e.g. from an event
+  // loop). False if data or a close arrived meanwhile, then do not wait.
+  bool prepare_wait()
+  {
+    header_->consumer_waiting.store(1);
+    if (header_->tail.load() != read_pos_ || header_->closed.load())
+    {
+      header_->consumer_waiting.store(0);
+      return false;
+    }
+    return true;
+  }
+
+  bool is_closed() const { return header_->closed.load(); }
+
+  // Consumer: give the space of a record (and everything before it) back.
+  // Records must be released in the order they were read.
+  void release(const Record &record)
+  {
+    header_->head.store(record.end, std::memory_order_release);
+    wake(header_->producer_waiting, space_fd_);
+  }
+
+  void close()
+  {
+    header_->closed.store(1);
+    signal(data_fd_);
+    signal(space_fd_);
+  }
+
+private:
+  static constexpr size_t HEADER_BYTES = 4096;
+  static constexpr size_t RECORD_HEADER = 8;
+  static constexpr uint32_t WRAP = UINT32_MAX;
+  static constexpr int SPIN = 4000;
+
+  ShmRing(int memfd, int data_fd, int space_fd)
+      : memfd_(memfd), data_fd_(data_fd), space_fd_(space_fd)
+  {
+    if (data_fd < 0 || space_fd < 0)
+      throw std::runtime_error("Could not create ring eventfds: " + std::string(strerror(errno)));
+    struct stat st;
+    if (::fstat(memfd, &st) < 0)
+      throw std::runtime_error("Could not stat shared ring: " + std::string(strerror(errno)));
+    void *base = ::mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (base == MAP_FAILED)
+      throw std::runtime_error("Could not map shared ring: " + std::string(strerror(errno)));
+    base_ = static_cast<char *>(base);
+    header_ = reinterpret_cast<ShmRingHeader *>(base_);
+    data_ = base_ + HEADER_BYTES;
+    capacity_ = st.st_size - HEADER_BYTES;
+  }
+
+  static size_t align(size_t size) { return (size + 7) & ~size_t(7); }
+
+  void put_header(size_t offset, uint32_t len, uint8_t tag)
+  {
+    std::memcpy(data_ + offset, &len, sizeof(len));
+    data_[offset + sizeof(len)] = static_cast<char>(tag);
+  }
+
+  void wait_for_space(uint64_t tail, size_t need)
+  {
+    for (int spin = 0;; spin++)
+    {
+      if (header_->closed.load(std::memory_order_relaxed))
+        throw std::runtime_error("Shared ring closed");
+      if (tail + need - header_->head.load(std::memory_order_acquire) <= capacity_)
+        return;
+      if (spin < SPIN)
+        continue;
+      park(header_->producer_waiting, space_fd_, [&]()
+           { return tail + need - header_->head.load() <= capacity_; });
+    }
+  }
+
+  bool wait_for_data()
+  {
+    for (int spin = 0;; spin++)
+    {
+      if (header_->tail.load(std::memory_order_acquire) != read_pos_)
+        return true;
+      if (header_->closed.load(std::memory_order_relaxed))
+        return false;
+      if (spin < SPIN)
+        continue;
+      park(header_->consumer_waiting, data_fd_, [&]()
+           { return header_->tail.load() != read_pos_; });
+    }
+  }
+
+  // Announce we are about to sleep, re-check, then block on the eventfd.
+  template <typename Ready>
+  void park(std::atomic<uint32_t> &waiting, int fd, Ready ready)
+  {
+    waiting.store(1);
+    if (ready() || header_->closed.load())
+    {
+      waiting.store(0);
+      return;
+    }
+    uint64_t value;
+    ssize_t ret = ::read(fd, &value, sizeof(value));
+    (void)ret;
+  }
+
+  void wake(std::atomic<uint32_t> &waiting, int fd)
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load(std::memory_order_relaxed) && waiting.exchange(0))
+      signal(fd);
+  }
+
+  static void signal(int fd)
+  {
+    uint64_t one = 1;
+    ssize_t ret = ::write(fd, &one, sizeof(one));
+    (void)ret;
+  }
+
+  int memfd_;
+  int data_fd_;
+  int space_fd_;
+  char *base_;
+  char *data_;
+  ShmRingHeader *header_;
+  size_t capacity_ = 0;
+  uint64_t read_pos_ = 0; // consumer only
+};
+
+#endif // SHM_RING_H
@@ -0,0 +1,928 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <map>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <boost/asio.hpp>
+#include <spdlog/spdlog.h>
+#include <websocketpp/server.hpp>
+#include <websocketpp/client.hpp>
+#include <websocketpp/config/asio_no_tls.hpp>
+#include "message.h"
+#include "shm_ring.h"
+
+typedef websocketpp::client<websocketpp::config::asio> client;
+typedef websocketpp::server<websocketpp::config::asio> server;
+
+// The sender of a received frame, as seen by the receiver: the way back to
+// it (flow-control credits travel there).
+class Peer
+{
+public:
+  virtual ~Peer() {}
+  virtual void send(std::string &&frame, Encoding encoding) = 0;
+};
+
+// A received frame. The payload is decoded in place from the buffer kept
+// alive by `owner` (websocketpp message or stream read buffer), it is never
+// copied out.
+struct Frame
+{
+  std::shared_ptr<const void> owner;
+  const char *data = nullptr;
+  size_t size = 0;
+  Encoding encoding = Encoding::JSON;
+  std::shared_ptr<Peer> peer; // null when the transport has no way back
+};
+
+using FrameHandler = std::function<void(Frame &&)>;
+
+// How frames travel between two engines. "ws" is the websocket transport,
+// "tcp" and "uds" are raw streams (TCP or Unix-domain socket) carrying
+// length-prefixed frames, "shm" a shared-memory ring per sender, for
+// engines sharing a host.
+enum class TransportKind
+{
+  WS,
+  TCP,
+  UDS,
+  SHM,
+};
+
+TransportKind string2transport(const std::string &name)
+{
+  if (name == "ws")
+    return TransportKind::WS;
+  if (name == "tcp")
+    return TransportKind::TCP;
+  if (name == "uds")
+    return TransportKind::UDS;
+  if (name == "shm")
+    return TransportKind::SHM;
+  throw std::invalid_argument("Unknown transport " + name);
+}
+
+// Unix-domain sockets are named after the port of the listening engine.
+std::string uds_path(int port)
+{
+  return "/tmp/roomie-" + std::to_string(port) + ".sock";
+}
+
+class ServerTransport
+{
+public:
+  virtual ~ServerTransport() {}
+  virtual void start(FrameHandler on_frame) = 0;
+  virtual void stop() = 0;
+};
+
+// Transports run on the io_service of their engine and own no thread.
+class ClientTransport
+{
+public:
+  virtual ~ClientTransport() {}
+  // on_open runs once the connection is up, on_frame for frames sent back.
+  virtual void start(std::function<void()> on_open, FrameHandler on_frame) = 0;
+  // Queue a frame, it is written asynchronously in send order. False when
+  // the frame was dropped right away, the connection being down.
+  virtual bool send(std::string &&frame, Encoding encoding) = 0;
+  virtual void stop() = 0;
+};
+
+class WsServerTransport : public ServerTransport
+{
+public:
+  WsServerTransport(boost::asio::io_service &io_service, const std::string &host, int port)
+      : io_service_(io_service), host_(host), port_(port) {}
+
+  void start(FrameHandler on_frame) override
+  {
+    on_frame_ = on_frame;
+    // Set logging settings
+    server_.get_alog().set_channels(websocketpp::log::alevel::none);
+
+    // Initialize Asio on the shared event loop
+    server_.init_asio(&io_service_);
+    server_.set_reuse_addr(true);
+
+    // Handle WebSocket connections
+    server_.set_open_handler([this](websocketpp::connection_hdl hdl)
+                             {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connections_[hdl] = std::make_shared<WsPeer>(server_, hdl);
+        spdlog::debug("[InPort] Client connected."); });
+    server_.set_close_handler([this](websocketpp::connection_hdl hdl)
+                              {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connections_.erase(hdl);
+        spdlog::debug("👋🏻[InPort] Server disconnected."); });
+    server_.set_fail_handler([this](websocketpp::connection_hdl)
+                             { spdlog::error("⛔️[InPort] Connection failed to host {} and port {}", host_, port_); });
+    server_.set_message_handler([this](websocketpp::connection_hdl hdl, server::message_ptr msg)
+                                {
+      // The sender picked the encoding of its connection, the opcode tells which one.
+      Encoding encoding = msg->get_opcode() == websocketpp::frame::opcode::binary ? Encoding::BINARY : Encoding::JSON;
+      const std::string &payload = msg->get_payload();
+      std::shared_ptr<Peer> peer;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = connections_.find(hdl);
+        if (it != connections_.end())
+          peer = it->second;
+      }
+      on_frame_(Frame{msg, payload.data(), payload.size(), encoding, std::move(peer)}); });
+
+    server_.listen(port_);
+    // Start the server accept loop
+    server_.start_accept();
+  }
+
+  // The io_service is shared, stop listening and close our connections
+  // rather than stopping the loop.
+  void stop() override
+  {
+    websocketpp::lib::error_code ec;
+    server_.stop_listening(ec);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &connection : connections_)
+    {
+      server_.close(connection.first, websocketpp::close::status::going_away, "", ec);
+    }
+    connections_.clear();
+  }
+
+private:
+  class WsPeer : public Peer
+  {
+  public:
+    WsPeer(server &endpoint, websocketpp::connection_hdl hdl) : endpoint_(endpoint), hdl_(hdl) {}
+
+    void send(std::string &&frame, Encoding encoding) override
+    {
+      auto opcode = encoding == Encoding::BINARY ? websocketpp::frame::opcode::binary : websocketpp::frame::opcode::text;
+      websocketpp::lib::error_code ec;
+      endpoint_.send(hdl_, frame.data(), frame.size(), opcode, ec);
+    }
+
+  private:
+    server &endpoint_;
+    websocketpp::connection_hdl hdl_;
+  };
+
+  boost::asio::io_service &io_service_;
+  std::string host_;
+  int port_;
+  server server_;
+  FrameHandler on_frame_;
+  std::mutex mutex_;
+  std::map<websocketpp::connection_hdl, std::shared_ptr<Peer>, std::owner_less<websocketpp::connection_hdl>> connections_;
+};
+
+class WsClientTransport : public ClientTransport
+{
+public:
+  WsClientTransport(boost::asio::io_service &io_service, const std::string &remote_host, int remote_port)
+      : io_service_(io_service), remote_host_(remote_host), remote_port_(remote_port), retry_timer_(io_service)
+  {
+    // ex. "ws://localhost:9002"
+    url_ = "ws://" + remote_host + ":" + std::to_string(remote_port);
+  }
+
+  void start(std::function<void()> on_open, FrameHandler on_frame) override
+  {
+    // Set logging to be pretty verbose (everything except message payloads)
+    client_.get_alog().set_channels(websocketpp::log::alevel::none);
+
+    // Initialize ASIO on the shared event loop
+    client_.init_asio(&io_service_);
+    client_.set_open_handler([this, on_open](websocketpp::connection_hdl hdl)
+                             {
+        this->hdl_ = hdl;
+        connected_ = true;
+        spdlog::debug("✅[OutPort] Connected successfully!");
+        on_open(); });
+
+    client_.set_close_handler([this](websocketpp::connection_hdl hdl)
+                              {
+        connected_ = false;
+        spdlog::debug("👋🏻[OutPort] Client disconnected."); });
+
+    client_.set_message_handler([on_frame](websocketpp::connection_hdl hdl, client::message_ptr msg)
+                                {
+      Encoding encoding = msg->get_opcode() == websocketpp::frame::opcode::binary ? Encoding::BINARY : Encoding::JSON;
+      const std::string &payload = msg->get_payload();
+      on_frame(Frame{msg, payload.data(), payload.size(), encoding}); });
+    client_.set_fail_handler([this](websocketpp::connection_hdl)
+                             {
+            connected_ = false;
+            spdlog::error("⛔️[OutPort] Connection failed to host {} and port {}\n\tRetrying...", remote_host_ ,remote_port_);
+            schedule_retry(); });
+
+    connect();
+  }
+
+  // websocketpp queues the frame on the connection and chains the writes.
+  bool send(std::string &&frame, Encoding encoding) override
+  {
+    auto opcode = encoding == Encoding::BINARY ? websocketpp::frame::opcode::binary : websocketpp::frame::opcode::text;
+    websocketpp::lib::error_code ec;
+    client_.send(hdl_, frame.data(), frame.size(), opcode, ec);
+    if (ec)
+    {
+      spdlog::error("⛔️ Connection lost\n\t{}", ec.message());
+      return false;
+    }
+    return true;
+  }
+
+  void stop() override
+  {
+    retry_timer_.cancel();
+    if (connected_)
+    {
+      websocketpp::lib::error_code ec;
+      client_.close(hdl_, websocketpp::close::status::going_away, "", ec);
+    }
+  }
+
+private:
+  void connect()
+  {
+    websocketpp::lib::error_code ec;
+    client::connection_ptr con = client_.get_connection(url_, ec);
+    if (ec)
+    {
+      spdlog::error("Could not create connection: {}", ec.message());
+      return;
+    }
+    client_.connect(con);
+  }
+
+  // Retries wait on a timer, never on a thread of the shared loop.
+  void schedule_retry()
+  {
+    if (retry_count_ >= max_retries_)
+    {
+      spdlog::error("⛔️ Max retries reached. Giving up.");
+      return;
+    }
+    retry_count_++;
+    retry_timer_.expires_from_now(std::chrono::seconds(3));
+    retry_timer_.async_wait([this](const boost::system::error_code &ec)
+                            {
+      if (!ec)
+        connect(); });
+  }
+
+  boost::asio::io_service &io_service_;
+  std::string remote_host_;
+  int remote_port_;
+  std::string url_;
+  client client_;
+  std::atomic<bool> connected_{false};
+  websocketpp::connection_hdl hdl_;
+  boost::asio::steady_timer retry_timer_;
+  int retry_count_ = 0;
+  const int max_retries_ = 20;
+};
+
+// Framing of the raw stream transports: u32 payload length, u8 encoding,
+// then the payload.
+namespace stream_framing
+{
+  constexpr size_t HEADER_SIZE = sizeof(uint32_t) + sizeof(uint8_t);
+  // Far above any message; a larger length means a desynced or bad peer.
+  constexpr uint32_t MAX_FRAME_SIZE = 64u << 20;
+
+  bool valid_header(uint32_t len, uint8_t encoding)
+  {
+    return len <= MAX_FRAME_SIZE &&
+           (encoding == static_cast<uint8_t>(Encoding::JSON) || encoding == static_cast<uint8_t>(Encoding::BINARY));
+  }
+
+  void write_header(char *header, size_t size, Encoding encoding)
+  {
+    uint32_t len = size;
+    std::memcpy(header, &len, sizeof(len));
+    header[sizeof(len)] = static_cast<char>(encoding);
+  }
+
+  void prepare(const boost::asio::ip::tcp::endpoint &) {}
+
+  // A stale socket file from a previous run would make bind() fail.
+  void prepare(const boost::asio::local::stream_protocol::endpoint &endpoint)
+  {
+    ::unlink(endpoint.path().c_str());
+  }
+}
+
+// Connected stream socket carrying frames both ways. Reads and writes are
+// chained on its strand, so whichever pool thread runs them they never
+// overlap; writes gather everything queued meanwhile.
+template <typename Protocol>
+class StreamConnection : public Peer, public std::enable_shared_from_this<StreamConnection<Protocol>>
+{
+public:
+  StreamConnection(boost::asio::io_service &io_service) : socket_(io_service), strand_(io_service) {}
+
+  typename Protocol::socket &socket() { return socket_; }
+  boost::asio::io_service::strand &strand() { return strand_; }
+  bool is_open() const { return open_.load(); }
+
+  // Once connected: run the read loop and flush what was queued so far.
+  void start(FrameHandler on_frame)
+  {
+    auto self = this->shared_from_this();
+    strand_.dispatch([this, self, on_frame]()
+                     {
+      on_frame_ = on_frame;
+      open_ = true;
+      read_header();
+      write_next(); });
+  }
+
+  void send(std::string &&frame, Encoding encoding) override
+  {
+    Pending pending;
+    stream_framing::write_header(pending.header, frame.size(), encoding);
+    pending.payload = std::move(frame);
+    auto self = this->shared_from_this();
+    strand_.post([this, self, pending = std::move(pending)]() mutable
+                 {
+      queue_.push_back(std::move(pending));
+      if (open_ && !writing_)
+        write_next(); });
+  }
+
+  void close()
+  {
+    auto self = this->shared_from_this();
+    strand_.post([this, self]()
+                 {
+      open_ = false;
+      boost::system::error_code ec;
+      socket_.shutdown(Protocol::socket::shutdown_both, ec);
+      socket_.close(ec); });
+  }
+
+private:
+  struct Pending
+  {
+    char header[stream_framing::HEADER_SIZE];
+    std::string payload;
+  };
+
+  void read_header()
+  {
+    auto self = this->shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(header_),
+                            strand_.wrap([this, self](const boost::system::error_code &ec, size_t)
+                                         {
+      if (ec)
+      {
+        spdlog::debug("👋🏻 Peer disconnected.");
+        open_ = false;
+        return;
+      }
+      uint32_t len;
+      std::memcpy(&len, header_, sizeof(len));
+      uint8_t encoding = static_cast<uint8_t>(header_[sizeof(len)]);
+      if (!stream_framing::valid_header(len, encoding))
+      {
+        // The stream cannot be resynced, drop the peer.
+        spdlog::error("⛔️ Bad frame header (length {}, encoding {}), closing the connection", len, encoding);
+        open_ = false;
+        boost::system::error_code ignored;
+        socket_.shutdown(Protocol::socket::shutdown_both, ignored);
+        socket_.close(ignored);
+        return;
+      }
+      read_body(len, static_cast<Encoding>(encoding)); }));
+  }
+
+  // The payload is read straight into the buffer the consumer decodes from.
+  void read_body(uint32_t len, Encoding encoding)
+  {
+    auto self = this->shared_from_this();
+    auto buffer = std::make_shared<std::string>(len, '\0');
+    boost::asio::async_read(socket_, boost::asio::buffer(&(*buffer)[0], len),
+                            strand_.wrap([this, self, buffer, encoding](const boost::system::error_code &ec, size_t)
+                                         {
+      if (ec)
+      {
+        spdlog::debug("👋🏻 Peer disconnected.");
+        open_ = false;
+        return;
+      }
+      if (on_frame_)
+        on_frame_(Frame{buffer, buffer->data(), buffer->size(), encoding, self});
+      read_header(); }));
+  }
+
+  // One gathered write for everything queued so far, frames queued while it
+  // is in flight go with the next one.
+  void write_next()
+  {
+    if (queue_.empty() || !open_)
+    {
+      writing_ = false;
+      return;
+    }
+    writing_ = true;
+    in_flight_ = std::min(queue_.size(), MAX_GATHER);
+    buffers_.clear();
+    for (size_t i = 0; i < in_flight_; i++)
+    {
+      buffers_.push_back(boost::asio::buffer(queue_[i].header));
+      buffers_.push_back(boost::asio::buffer(queue_[i].payload));
+    }
+    auto self = this->shared_from_this();
+    boost::asio::async_write(socket_, buffers_, strand_.wrap([this, self](const boost::system::error_code &ec, size_t)
+                                                             {
+      if (ec)
+      {
+        spdlog::error("⛔️ Connection lost\n\t{}", ec.message());
+        writing_ = false;
+        open_ = false;
+        return;
+      }
+      queue_.erase(queue_.begin(), queue_.begin() + in_flight_);
+      write_next(); }));
+  }
+
+  static constexpr size_t MAX_GATHER = 64;
+
+  typename Protocol::socket socket_;
+  boost::asio::io_service::strand strand_;
+  FrameHandler on_frame_;
+  char header_[stream_framing::HEADER_SIZE];
+  std::deque<Pending> queue_; // deque: in-flight buffers stay put while frames are appended
+  std::vector<boost::asio::const_buffer> buffers_;
+  size_t in_flight_ = 0;
+  std::atomic<bool> open_{false}; // written on the strand, read by senders too
+  bool writing_ = false;
+};
+
+template <typename Protocol>
+class StreamServerTransport : public ServerTransport
+{
+public:
+  StreamServerTransport(boost::asio::io_service &io_service, const typename Protocol::endpoint &endpoint)
+      : io_service_(io_service), endpoint_(endpoint), acceptor_(io_service), strand_(io_service) {}
+
+  void start(FrameHandler on_frame) override
+  {
+    on_frame_ = on_frame;
+    stream_framing::prepare(endpoint_);
+    acceptor_.open(endpoint_.protocol());
+    acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
+    acceptor_.bind(endpoint_);
+    acceptor_.listen();
+    accept();
+  }
+
+  void stop() override
+  {
+    strand_.post([this]()
+                 {
+      boost::system::error_code ec;
+      acceptor_.close(ec); });
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &weak : connections_)
+    {
+      if (auto connection = weak.lock())
+      {
+        connection->close();
+      }
+    }
+    connections_.clear();
+  }
+
+private:
+  using Connection = StreamConnection<Protocol>;
+
+  void accept()
+  {
+    auto connection = std::make_shared<Connection>(io_service_);
+    acceptor_.async_accept(connection->socket(), strand_.wrap([this, connection](const boost::system::error_code &ec)
+                                                              {
+      if (ec == boost::asio::error::operation_aborted)
+        return;
+      if (!ec)
+      {
+        spdlog::debug("[InPort] Client connected.");
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [](const std::weak_ptr<Connection> &weak)
+                                            { return weak.expired(); }),
+                             connections_.end());
+          connections_.push_back(connection);
+        }
+        connection->start(on_frame_);
+      }
+      accept(); }));
+  }
+
+  boost::asio::io_service &io_service_;
+  typename Protocol::endpoint endpoint_;
+  typename Protocol::acceptor acceptor_;
+  boost::asio::io_service::strand strand_;
+  FrameHandler on_frame_;
+  std::mutex mutex_;
+  std::vector<std::weak_ptr<Connection>> connections_;
+};
+
+template <typename Protocol>
+class StreamClientTransport : public ClientTransport
+{
+public:
+  StreamClientTransport(boost::asio::io_service &io_service, const typename Protocol::endpoint &endpoint, const std::string &name)
+      : endpoint_(endpoint), name_(name), connection_(std::make_shared<StreamConnection<Protocol>>(io_service)), retry_timer_(io_service) {}
+
+  void start(std::function<void()> on_open, FrameHandler on_frame) override
+  {
+    on_open_ = on_open;
+    on_frame_ = on_frame;
+    connection_->strand().dispatch([this]()
+                                   { connect(); });
+  }
+
+  // Frames sent before the connection is up wait in the connection queue.
+  // Frames queued on a lost connection would never be written.
+  bool send(std::string &&frame, Encoding encoding) override
+  {
+    if (!connection_->is_open())
+    {
+      return false;
+    }
+    connection_->send(std::move(frame), encoding);
+    return true;
+  }
+
+  void stop() override
+  {
+    connection_->strand().post([this]()
+                               {
+      boost::system::error_code ec;
+      retry_timer_.cancel(ec); });
+    connection_->close();
+  }
+
+private:
+  // Runs on the connection strand.
+  void connect()
+  {
+    connection_->socket().async_connect(endpoint_, connection_->strand().wrap([this](const boost::system::error_code &ec)
+                                                                              {
+      if (!ec)
+      {
+        spdlog::debug("✅[OutPort] Connected successfully!");
+        connection_->start(on_frame_);
+        on_open_();
+        return;
+      }
+      if (ec == boost::asio::error::operation_aborted)
+        return;
+      boost::system::error_code ignored;
+      connection_->socket().close(ignored);
+      if (retry_count_++ >= max_retries_)
+      {
+        spdlog::error("⛔️ Max retries reached. Giving up.");
+        return;
+      }
+      spdlog::error("⛔️[OutPort] Connection failed to {}\n\tRetrying...", name_);
+      retry_timer_.expires_from_now(std::chrono::seconds(3));
+      retry_timer_.async_wait(connection_->strand().wrap([this](const boost::system::error_code &ec)
+                                                         {
+        if (!ec)
+          connect(); })); }));
+  }
+
+  typename Protocol::endpoint endpoint_;
+  std::string name_;
+  std::shared_ptr<StreamConnection<Protocol>> connection_;
+  boost::asio::steady_timer retry_timer_;
+  std::function<void()> on_open_;
+  FrameHandler on_frame_;
+  int retry_count_ = 0;
+  const int max_retries_ = 20;
+};
+
+// The shm transport hands rings over a Unix-domain control socket: each
+// sender creates its ring (memfd + two eventfds) and passes the descriptors
+// with SCM_RIGHTS, the listener then runs one reader per ring. The control
+// socket stays open afterwards as the way back to the sender.
+namespace shm_control
+{
+  std::string path(int port)
+  {
+    return "/tmp/roomie-" + std::to_string(port) + ".shm.sock";
+  }
+
+  bool send_fds(int sock, const int (&fds)[3])
+  {
+    char byte = 0;
+    iovec iov{&byte, 1};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    return ::sendmsg(sock, &msg, 0) == 1;
+  }
+
+  bool recv_fds(int sock, int (&fds)[3])
+  {
+    char byte;
+    iovec iov{&byte, 1};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(sock, &msg, 0) != 1)
+      return false;
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+      return false;
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return true;
+  }
+}
+
+class ShmServerTransport : public ServerTransport
+{
+public:
+  ShmServerTransport(boost::asio::io_service &io_service, int port)
+      : io_service_(io_service), path_(shm_control::path(port)), acceptor_(io_service), strand_(io_service) {}
+
+  void start(FrameHandler on_frame) override
+  {
+    on_frame_ = on_frame;
+    ::unlink(path_.c_str());
+    acceptor_.open();
+    acceptor_.bind(boost::asio::local::stream_protocol::endpoint(path_));
+    acceptor_.listen();
+    accept();
+  }
+
+  void stop() override
+  {
+    strand_.post([this]()
+                 {
+      boost::system::error_code ec;
+      acceptor_.close(ec); });
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &reader : readers_)
+    {
+      reader->ring->close();
+      reader->control->close();
+    }
+    readers_.clear();
+    ::unlink(path_.c_str());
+  }
+
+private:
+  using Control = StreamConnection<boost::asio::local::stream_protocol>;
+
+  // The consumer parks by waiting for data_fd() to become readable on the
+  // loop, a dup so the descriptor and the ring each close their own.
+  struct Reader
+  {
+    Reader(boost::asio::io_service &io_service, std::shared_ptr<ShmRing> ring, std::shared_ptr<Control> control)
+        : ring(ring), control(control), wakeup(io_service, ::dup(ring->data_fd())) {}
+    std::shared_ptr<ShmRing> ring;
+    std::shared_ptr<Control> control;
+    boost::asio::posix::stream_descriptor wakeup;
+    uint64_t counter;
+  };
+
+  static constexpr int SPIN = 200;
+  static constexpr int MAX_BURST = 256;
+
+  void accept()
+  {
+    auto control = std::make_shared<Control>(io_service_);
+    acceptor_.async_accept(control->socket(), strand_.wrap([this, control](const boost::system::error_code &ec)
+                                                           {
+      if (ec == boost::asio::error::operation_aborted)
+        return;
+      if (!ec)
+        handshake(control);
+      accept(); }));
+  }
+
+  // The sender writes the descriptors right after connecting.
+  void handshake(std::shared_ptr<Control> control)
+  {
+    control->socket().async_wait(boost::asio::socket_base::wait_read, [this, control](const boost::system::error_code &ec)
+                                 {
+      if (ec)
+        return;
+      int fds[3];
+      if (!shm_control::recv_fds(control->socket().native_handle(), fds))
+      {
+        spdlog::error("⛔️[InPort] Bad shared ring handshake on {}", path_);
+        control->close();
+        return;
+      }
+      spdlog::debug("[InPort] Client connected.");
+      auto reader = std::make_shared<Reader>(io_service_, std::shared_ptr<ShmRing>(ShmRing::attach(fds[0], fds[1], fds[2])), control);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        readers_.push_back(reader);
+      }
+      control->start(nullptr);
+      drain(reader); });
+  }
+
+  // Frames point into the ring, their space is released once the consumer
+  // is done decoding (InPort consumes frames in order). A reader spins a
+  // little, then goes back to the loop until the producer signals.
+  void drain(std::shared_ptr<Reader> reader)
+  {
+    ShmRing &ring = *reader->ring;
+    ShmRing::Record record;
+    int burst = 0;
+    for (int spin = 0; spin < SPIN; spin++)
+    {
+      while (ring.try_read(record))
+      {
+        std::shared_ptr<const void> owner(record.data, [ring = reader->ring, record](const void *)
+                                          { ring->release(record); });
+        on_frame_(Frame{std::move(owner), record.data, record.size, static_cast<Encoding>(record.tag), reader->control});
+        spin = 0;
+        if (++burst == MAX_BURST)
+        {
+          // Let the other connections of the loop run.
+          io_service_.post([this, reader]()
+                           { drain(reader); });
+          return;
+        }
+      }
+    }
+    if (ring.is_closed())
+    {
+      spdlog::debug("👋🏻[InPort] Client disconnected.");
+      return;
+    }
+    if (!ring.prepare_wait())
+    {
+      io_service_.post([this, reader]()
+                       { drain(reader); });
+      return;
+    }
+    reader->wakeup.async_read_some(boost::asio::buffer(&reader->counter, sizeof(reader->counter)),
+                                   [this, reader](const boost::system::error_code &ec, size_t)
+                                   {
+                                     if (!ec)
+                                       drain(reader);
+                                   });
+  }
+
+  boost::asio::io_service &io_service_;
+  std::string path_;
+  boost::asio::local::stream_protocol::acceptor acceptor_;
+  boost::asio::io_service::strand strand_;
+  FrameHandler on_frame_;
+  std::mutex mutex_;
+  std::vector<std::shared_ptr<Reader>> readers_;
+};
+
+// Writes go straight into the ring from the sending thread and only block
+// while the ring is full; the control socket carries the handshake, then
+// whatever the receiver sends back.
+class ShmClientTransport : public ClientTransport
+{
+public:
+  ShmClientTransport(boost::asio::io_service &io_service, int remote_port, size_t ring_bytes)
+      : path_(shm_control::path(remote_port)), ring_bytes_(ring_bytes),
+        control_(std::make_shared<StreamConnection<boost::asio::local::stream_protocol>>(io_service)), retry_timer_(io_service) {}
+
+  void start(std::function<void()> on_open, FrameHandler on_frame) override
+  {
+    ring_ = ShmRing::create(ring_bytes_);
+    on_open_ = on_open;
+    on_frame_ = on_frame;
+    control_->strand().dispatch([this]()
+                                { connect(); });
+  }
+
+  bool send(std::string &&frame, Encoding encoding) override
+  {
+    ring_->write(frame, static_cast<uint8_t>(encoding));
+    return true;
+  }
+
+  void stop() override
+  {
+    if (ring_)
+    {
+      ring_->close();
+    }
+    control_->strand().post([this]()
+                            {
+      boost::system::error_code ec;
+      retry_timer_.cancel(ec); });
+    control_->close();
+  }
+
+private:
+  // Runs on the control strand.
+  void connect()
+  {
+    auto &socket = control_->socket();
+    socket.async_connect(boost::asio::local::stream_protocol::endpoint(path_), control_->strand().wrap([this, &socket](const boost::system::error_code &ec)
+                                                                                                      {
+      if (ec == boost::asio::error::operation_aborted)
+        return;
+      int fds[3] = {ring_->memfd(), ring_->data_fd(), ring_->space_fd()};
+      if (!ec && shm_control::send_fds(socket.native_handle(), fds))
+      {
+        spdlog::debug("✅[OutPort] Connected successfully!");
+        control_->start(on_frame_);
+        on_open_();
+        return;
+      }
+      boost::system::error_code ignored;
+      socket.close(ignored);
+      if (retry_count_++ >= max_retries_)
+      {
+        spdlog::error("⛔️ Max retries reached. Giving up.");
+        return;
+      }
+      spdlog::error("⛔️[OutPort] Connection failed to {}\n\tRetrying...", path_);
+      retry_timer_.expires_from_now(std::chrono::seconds(3));
+      retry_timer_.async_wait(control_->strand().wrap([this](const boost::system::error_code &ec)
+                                                      {
+        if (!ec)
+          connect(); })); }));
+  }
+
+  std::string path_;
+  size_t ring_bytes_;
+  std::unique_ptr<ShmRing> ring_;
+  std::shared_ptr<StreamConnection<boost::asio::local::stream_protocol>> control_;
+  boost::asio::steady_timer retry_timer_;
+  std::function<void()> on_open_;
+  FrameHandler on_frame_;
+  int retry_count_ = 0;
+  const int max_retries_ = 20;
+};
+
+std::unique_ptr<ServerTransport> make_server_transport(TransportKind kind, boost::asio::io_service &io_service, const std::string &host, int port)
+{
+  switch (kind)
+  {
+  case TransportKind::TCP:
+    return std::make_unique<StreamServerTransport<boost::asio::ip::tcp>>(
+        io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port));
+  case TransportKind::UDS:
+    return std::make_unique<StreamServerTransport<boost::asio::local::stream_protocol>>(
+        io_service, boost::asio::local::stream_protocol::endpoint(uds_path(port)));
+  case TransportKind::SHM:
+    return std::make_unique<ShmServerTransport>(io_service, port);
+  default:
+    return std::make_unique<WsServerTransport>(io_service, host, port);
+  }
+}
+
+std::unique_ptr<ClientTransport> make_client_transport(TransportKind kind, boost::asio::io_service &io_service, const std::string &remote_host, int remote_port, size_t shm_ring_bytes = 1 << 22)
+{
+  switch (kind)
+  {
+  case TransportKind::TCP:
+  {
+    boost::asio::ip::tcp::resolver resolver(io_service);
+    auto endpoint = resolver.resolve(remote_host, std::to_string(remote_port)).begin()->endpoint();
+    return std::make_unique<StreamClientTransport<boost::asio::ip::tcp>>(
+        io_service, endpoint, "tcp://" + remote_host + ":" + std::to_string(remote_port));
+  }
+  case TransportKind::UDS:
+    return std::make_unique<StreamClientTransport<boost::asio::local::stream_protocol>>(
+        io_service, boost::asio::local::stream_protocol::endpoint(uds_path(remote_port)), "unix://" + uds_path(remote_port));
+  case TransportKind::SHM:
+    return std::make_unique<ShmClientTransport>(io_service, remote_port, shm_ring_bytes);
+  default:
+    return std::make_unique<WsClientTransport>(io_service, remote_host, remote_port);
+  }
+}
+
+#endif // TRANSPORT_H
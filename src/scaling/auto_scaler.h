@@ -3,6 +3,7 @@
 
 #include <map>
 #include "utils/general.h"
+#include "utils/async.h"
 #include "utils/datastore.h"
 #include "networking/message.h"
 #include "scheduling/base_scheduler.h"
@@ -30,77 +31,76 @@ public:
     event_.set();
   }
 
-  void run()
+  // Checks the apps every interval seconds on the io loop, once set_event()
+  // announced the first registration.
+  Job run(boost::asio::io_service &io)
   {
-    event_.wait();
-    spdlog::debug( "😎 [auto-scaler] About to start the auto-scaling." );
-
-    // Start monitoring loop
+    co_await schedule(io);
     while (true)
     {
-      std::this_thread::sleep_for(std::chrono::seconds(interval));
-      std::pair<std::string, double> most_overloaded_app = {"", 0.0};
-
-      for (const auto &[app_id, names] : datastore_->get_registration())
+      co_await sleep_for(io, std::chrono::seconds(interval));
+      if (event_.is_set())
       {
-        if (locker_.find(app_id) != locker_.end() && locker_[app_id] > 0)
-        {
-          cout << "Locker for app " << app_id << " is " << locker_[app_id] << endl;
-          locker_[app_id]--;
-          continue;
-        }
+        step();
+      }
+    }
+  }
 
-        std::vector<Model *> running_variants;
-        for (Worker *worker : datastore_->get_workers())
-        {
-          for (Model *variant : worker->get_variants())
-          {
-            if (std::find(names.begin(), names.end(), variant->name) != names.end())
-            {
-              running_variants.push_back(variant);
-            }
-          }
-        }
+  // Decides on one DataStore snapshot, profiles keep coming in meanwhile.
+  void step()
+  {
+    auto snapshot = datastore_->snapshot();
+    std::pair<std::string, double> most_overloaded_app = {"", 0.0};
 
-        if (running_variants.empty())
-          continue;
+    for (const auto &[app_id, names] : snapshot->get_registration())
+    {
+      if (locker_.find(app_id) != locker_.end() && locker_[app_id] > 0)
+      {
+        spdlog::debug("🔵 [auto-scaler] Locker for app {} is {}", app_id, locker_[app_id]);
+        locker_[app_id]--;
+        continue;
+      }
 
-        double throughput = 0.0;
-        double workload = 0.0;
-        for (Model *variant : running_variants)
-        {
-          throughput += variant->compute_throughput();
-          workload += variant->compute_workload();
-        }
-        double ratio = workload / throughput;
-        if (ratio > most_overloaded_app.second)
-        {
-          most_overloaded_app = {app_id, ratio};
-        }
+      std::vector<Model *> running_variants = snapshot->get_variants(app_id);
 
-        // spdlog::debug( "🔵 [auto-scaler] For " + app_id + " Load=" + std::to_string(workload) + ", Thr=" + std::to_string(throughput) + ", Ratio=" + std::to_string(ratio) << std::endl;
-      }
+      if (running_variants.empty())
+        continue;
 
-      auto [app_id, ratio] = most_overloaded_app;
-      try
+      double throughput = 0.0;
+      double workload = 0.0;
+      for (Model *variant : running_variants)
       {
-        if (ratio > 0)
-        {
-          auto_scale(app_id, ratio);
-        }
+        throughput += variant->compute_throughput();
+        workload += variant->compute_workload();
       }
-      catch (const std::exception &e)
+      double ratio = workload / throughput;
+      if (ratio > most_overloaded_app.second)
       {
-        std::cerr << e.what() << '\n';
+        most_overloaded_app = {app_id, ratio};
       }
+
+      // spdlog::debug( "🔵 [auto-scaler] For " + app_id + " Load=" + std::to_string(workload) + ", Thr=" + std::to_string(throughput) + ", Ratio=" + std::to_string(ratio) << std::endl;
+    }
+
+    auto [app_id, ratio] = most_overloaded_app;
+    try
+    {
+      if (ratio > 0)
+      {
+        auto_scale(*snapshot, app_id, ratio);
+      }
+    }
+    catch (const std::exception &e)
+    {
+      spdlog::error("⛔️ [auto-scaler] Step failed\n\t{}", e.what());
     }
   }
 
-  bool auto_scale(const string &app_id, double ratio)
+  bool auto_scale(const DataSnapshot &snapshot, const string &app_id, double ratio)
   {
     if (ratio < 0.5)
     {
-      auto departure = Downscaling(app_id, true);
+      auto departure = Downscaling(snapshot, app_id, true);
       if (departure.first != nullptr)
       {
         on_stop_(app_id, *departure.first, *departure.second);
@@ -109,7 +109,7 @@ public:
     }
     else if (ratio < 0.8)
     {
-      auto departure = Downscaling(app_id, false);
+      auto departure = Downscaling(snapshot, app_id, false);
       if (departure.first != nullptr)
       {
         on_stop_(app_id, *departure.first, *departure.second);
@@ -118,7 +118,7 @@ public:
     }
     else if (ratio > threshold)
     {
-      auto upscaling = Upscaling(app_id);
+      auto upscaling = Upscaling(snapshot, app_id);
       if (upscaling.first != nullptr)
       {
 
@@ -134,10 +134,10 @@ public:
     return false;
   }
 
-  std::pair<Model *, Worker *> Upscaling(const string &app_id)
+  std::pair<Model *, Worker *> Upscaling(const DataSnapshot &snapshot, const string &app_id)
   {
     std::vector<Worker *> _workers;
-    for (const auto worker : datastore_->get_workers())
+    for (const auto worker : snapshot.get_workers())
     {
       if (!worker->is_deploying())
       {
@@ -151,16 +151,16 @@ public:
     }
 
     std::vector<std::string> names;
-    for (const auto name : datastore_->get_registered(app_id))
+    for (const auto name : snapshot.get_registered(app_id))
     {
       names.push_back(name);
     }
     return scheduler_->schedule(_workers, names);
   }
 
-  std::pair<Model *, Worker *> Downscaling(const string &app_id, bool force)
+  std::pair<Model *, Worker *> Downscaling(const DataSnapshot &snapshot, const string &app_id, bool force)
   {
-    std::vector<std::pair<Model *, Worker *>> candidates = datastore_->get_variant_workers(app_id);
+    std::vector<std::pair<Model *, Worker *>> candidates = snapshot.get_variant_workers(app_id);
     if (candidates.size() > 1)
     {
       if (force)
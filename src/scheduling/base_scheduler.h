@@ -8,13 +8,15 @@
 class Scheduler
 {
 protected:
-  std::map<std::string, Model *> cache;
+  std::map<std::string, std::shared_ptr<const ModelProfile>> cache;
 
 public:
   Scheduler() {}
   virtual std::pair<Model *, Worker *> schedule(std::vector<Worker *> &workers, std::vector<std::string> &variant_candidates) = 0;
 
-  Model *load_model_metadata(string hardware_platform, string variant_name)
+  // Candidates are Model(profile, batch_size) values, only the chosen one
+  // is allocated for deployment.
+  std::shared_ptr<const ModelProfile> load_model_metadata(const string &hardware_platform, const string &variant_name)
   {
     std::string key = hardware_platform + "_" + variant_name;
     auto it = cache.find(key);
@@ -23,10 +25,9 @@ public:
       return it->second;
     }
 
-    Model *model = new Model(0, variant_name, hardware_platform);
-    pre_profiled(*model);
-    cache[key] = model;
-    return model;
+    auto profile = pre_profiled(variant_name, hardware_platform);
+    cache[key] = profile;
+    return profile;
   }
 };
 
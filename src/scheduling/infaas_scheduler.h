@@ -18,13 +18,13 @@ public:
 
   std::pair<Model *, Worker *> get_variant(std::vector<Worker *> &workers, std::vector<std::string> &variant_candidates)
   {
-    std::vector<std::pair<Model *, Worker *>> current_workers;
+    std::vector<std::pair<Model, Worker *>> current_workers;
 
     for (const auto &variant_name : variant_candidates)
     {
       for (auto *worker : workers)
       {
-        Model *variant;
+        std::shared_ptr<const ModelProfile> variant;
         try
         {
           variant = this->load_model_metadata(worker->get_hardware_platform(), variant_name);
@@ -37,12 +37,11 @@ public:
 
         for (int batch_size : BATCH_SIZES)
         {
-          Model *new_variant = new Model(*variant);
-          new_variant->batch_size = batch_size;
-          if (new_variant->get_profile_throughput() == 0 ||
-              worker->percent_occupation(new_variant->get_memory()) > MAX_GPU_MEMORY_OCCUPANCY)
+          Model new_variant(variant, batch_size);
+          if (new_variant.get_profile_throughput() == 0 ||
+              worker->percent_occupation(new_variant.get_memory()) > MAX_GPU_MEMORY_OCCUPANCY)
           {
-            // std::cerr << "Not enough memory for " + new_variant->to_string() + "\n\t Occupancy would be: " + std::to_string(worker->percent_occupation(new_variant->get_memory())) << std::endl;
+            // std::cerr << "Not enough memory for " + new_variant.to_string() + "\n\t Occupancy would be: " + std::to_string(worker->percent_occupation(new_variant->get_memory())) << std::endl;
             continue;
           }
 
@@ -57,17 +56,16 @@ public:
       {
         for (auto *worker : workers)
         {
-          Model *variant = this->load_model_metadata(worker->get_hardware_platform(), variant_name);
+          auto variant = this->load_model_metadata(worker->get_hardware_platform(), variant_name);
 
           for (int batch_size : BATCH_SIZES)
           {
-            Model *new_variant = new Model(*variant);
-            new_variant->batch_size = batch_size;
+            Model new_variant(variant, batch_size);
 
-            if (new_variant->get_profile_throughput() == 0 ||
-                worker->percent_occupation(new_variant->get_memory()) > MAX_GPU_MEMORY_OCCUPANCY)
+            if (new_variant.get_profile_throughput() == 0 ||
+                worker->percent_occupation(new_variant.get_memory()) > MAX_GPU_MEMORY_OCCUPANCY)
             {
-              // std::cout << "--> Cannot hold " << new_variant->to_string() << " Free mem: " << worker->percent_occupation(new_variant->get_memory()) << "(" << MAX_GPU_MEMORY_OCCUPANCY << "%)" << std::endl;
+              // std::cout << "--> Cannot hold " << new_variant.to_string() << " Free mem: " << worker->percent_occupation(new_variant->get_memory()) << "(" << MAX_GPU_MEMORY_OCCUPANCY << "%)" << std::endl;
               continue;
             }
 
@@ -83,15 +81,15 @@ public:
       return {nullptr, nullptr};
     }
 
-    std::sort(current_workers.begin(), current_workers.end(),
-              [](const std::pair<Model *, Worker *> a, const std::pair<Model *, Worker *> b)
-              {
-                if (a.first->get_profile_throughput() != b.first->get_profile_throughput())
-                  return a.first->get_profile_throughput() > b.first->get_profile_throughput();
-                return a.second->get_free_memory() > b.second->get_free_memory();
-              });
+    auto best = std::min_element(current_workers.begin(), current_workers.end(),
+                                 [](const std::pair<Model, Worker *> &a, const std::pair<Model, Worker *> &b)
+                                 {
+                                   if (a.first.get_profile_throughput() != b.first.get_profile_throughput())
+                                     return a.first.get_profile_throughput() > b.first.get_profile_throughput();
+                                   return a.second->get_free_memory() > b.second->get_free_memory();
+                                 });
 
-    return current_workers.front();
+    return {new Model(best->first), best->second};
   }
 };
 
@@ -70,7 +70,7 @@ public:
 
   std::pair<Model *, Worker *> schedule(std::vector<Worker *> &workers, std::vector<std::string> &variant_candidates) override
   {
-    std::vector<std::tuple<Model *, Worker *, std::vector<float>>> simulations;
+    std::vector<std::tuple<Model, Worker *, std::vector<float>>> simulations;
 
     for (auto &variant_name : variant_candidates)
     {
@@ -109,21 +109,21 @@ public:
 
     auto &best = simulations.front();
 
-    return {std::get<0>(best), std::get<1>(best)};
+    return {new Model(std::get<0>(best)), std::get<1>(best)};
   }
 
-  std::vector<std::tuple<Model *, Worker *, std::vector<float>>> simulate(
+  std::vector<std::tuple<Model, Worker *, std::vector<float>>> simulate(
       const std::vector<Worker *> &workers,
       std::string &variant_name)
   {
-    std::vector<std::tuple<Model *, Worker *, std::vector<float>>> results;
+    std::vector<std::tuple<Model, Worker *, std::vector<float>>> results;
 
     for (Worker *worker : workers)
     {
       auto computations = this->compute(variant_name, worker);
-      for (std::pair<Model *, std::vector<float>> item : computations)
+      for (auto &item : computations)
       {
-        results.push_back({item.first, worker, item.second});
+        results.emplace_back(item.first, worker, std::move(item.second));
       }
     }
 
@@ -202,14 +202,14 @@ public:
     return {durations, new_durations};
   }
 
-  std::vector<std::pair<Model *, std::vector<float>>> compute(std::string &variant_name, Worker *&worker)
+  std::vector<std::pair<Model, std::vector<float>>> compute(std::string &variant_name, Worker *&worker)
   {
-    std::vector<std::pair<Model *, std::vector<float>>> results;
-    Model *variant;
+    std::vector<std::pair<Model, std::vector<float>>> results;
+    auto profile = this->load_model_metadata(worker->get_hardware_platform(), variant_name);
     for (int batch_size : BATCH_SIZES)
     {
-      variant = new Model(*this->load_model_metadata(worker->get_hardware_platform(), variant_name));
-      variant->batch_size = batch_size;
+      Model candidate(profile, batch_size);
+      Model *variant = &candidate;
 
       if (worker->percent_occupation(variant->get_memory()) > MAX_GPU_MEMORY_OCCUPANCY || variant->get_profile_throughput() == 0)
       {
@@ -232,7 +232,7 @@ public:
         if (history_.find(key) != history_.end())
         {
           perf_drops = history_[key];
-          results.push_back({variant, perf_drops});
+          results.push_back({candidate, perf_drops});
           continue;
         }
 
@@ -272,7 +272,7 @@ public:
         perf_drops = {0.0};
       }
 
-      results.push_back({variant, perf_drops});
+      results.push_back({candidate, perf_drops});
     }
 
     return results;
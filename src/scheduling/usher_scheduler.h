@@ -2,6 +2,7 @@
 #define USHER_SCHEDULER_H
 
 #include <math.h>
+#include <deque>
 #include "base_scheduler.h"
 #include "utils/general.h"
 #include "utils/datastore.h"
@@ -34,6 +35,19 @@ public:
     c_req = Creq(*model);
     m_req = Mreq(*model, worker->get_total_memory());
   }
+
+  // A candidate that is not deployed, held by value.
+  UsherModel(const Model &candidate_, Worker *worker) : candidate(candidate_)
+  {
+    model = &candidate;
+    c_req = Creq(*model);
+    m_req = Mreq(*model, worker->get_total_memory());
+  }
+
+  UsherModel(const UsherModel &) = delete;
+
+private:
+  Model candidate;
 };
 
 bool Cheavy(UsherModel &variant, float threshold = 1.2)
@@ -57,7 +71,8 @@ public:
 
   std::pair<Model *, Worker *> schedule(std::vector<Worker *> &workers, std::vector<std::string> &variant_candidates) override
   {
-    auto variant_workers = usher(workers, variant_candidates);
+    std::deque<UsherModel> pool; // every wrapper of this round, freed with it
+    auto variant_workers = usher(workers, variant_candidates, pool);
 
     std::sort(variant_workers.begin(), variant_workers.end(), [](const std::tuple<Model *, Worker *, float> a, const std::tuple<Model *, Worker *, float> b)
               { return -get<0>(a)->get_profile_throughput() < -get<0>(b)->get_profile_throughput(); });
@@ -69,17 +84,17 @@ public:
     }
     auto variant = get<0>(variant_workers[0]);
     auto worker = get<1>(variant_workers[0]);
-    return {variant, worker};
+    return {new Model(*variant), worker};
   }
 
-  std::vector<std::tuple<Model *, Worker *, float>> usher(std::vector<Worker *> workers, std::vector<string> variant_candidates)
+  std::vector<std::tuple<Model *, Worker *, float>> usher(std::vector<Worker *> workers, std::vector<string> variant_candidates, std::deque<UsherModel> &pool)
   {
     std::vector<std::tuple<Model *, Worker *, float>> variant_workers;
     for (const auto &variant_name : variant_candidates)
     {
       for (const int &batch_size : BATCH_SIZES)
       {
-        auto groups = variant_grouping(workers, variant_name, batch_size);
+        auto groups = variant_grouping(workers, variant_name, batch_size, pool);
         auto result = decision_configuration_and_placement(groups, workers);
         for (const std::tuple<Model *, Worker *, float> item : result)
         {
@@ -90,7 +105,7 @@ public:
     return variant_workers;
   }
 
-  std::vector<std::vector<UsherModel *>> variant_grouping(vector<Worker *> workers, const string &variant_name, int batch_size, int max_variants_group = 4)
+  std::vector<std::vector<UsherModel *>> variant_grouping(vector<Worker *> workers, const string &variant_name, int batch_size, std::deque<UsherModel> &pool, int max_variants_group = 4)
   {
     std::vector<UsherModel *> variants;
     std::vector<std::string> hardware_platforms;
@@ -102,14 +117,12 @@ public:
         continue;
       }
       hardware_platforms.push_back(worker->get_hardware_platform());
-      Model *variant = new Model(*this->load_model_metadata(worker->get_hardware_platform(), variant_name));
-      variant->batch_size = batch_size;
-      if (variant->get_profile_throughput() == 0)
+      Model variant(this->load_model_metadata(worker->get_hardware_platform(), variant_name), batch_size);
+      if (variant.get_profile_throughput() == 0)
       {
         continue;
       }
-      UsherModel *usher_variant = new UsherModel(variant, worker);
-      variants.push_back(usher_variant);
+      variants.push_back(&pool.emplace_back(variant, worker));
     }
 
     std::vector<std::vector<UsherModel *>> groups;
@@ -118,7 +131,7 @@ public:
       std::vector<UsherModel *> group;
       for (auto &variant : worker->get_variants())
       {
-        group.push_back(new UsherModel(variant, worker));
+        group.push_back(&pool.emplace_back(variant, worker));
       }
       groups.push_back(group);
     }
@@ -358,14 +371,13 @@ public:
         }
 
         std::vector<float> c_space_m_space;
-        UsherModel *tmp;
         for (auto &worker : worker_candidates)
         {
           float total = 0;
           for (auto &v : worker->get_variants())
           {
-            tmp = new UsherModel(v, worker);
-            total += tmp->c_req + tmp->m_req;
+            UsherModel tmp(v, worker);
+            total += tmp.c_req + tmp.m_req;
           }
           total += wrapper->c_req + wrapper->m_req;
           c_space_m_space.push_back(total);
@@ -0,0 +1,266 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <optional>
+#include <coroutine>
+#include <spdlog/spdlog.h>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+// Coroutines on an io_service: a suspended coroutine costs no thread, it is
+// resumed by a post() on the loop once what it awaits is there.
+
+// Fire-and-forget coroutine. It starts right away on the caller's thread
+// (co_await schedule(io) moves it to the loop) and frees itself when done.
+struct Job
+{
+  struct promise_type
+  {
+    Job get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception()
+    {
+      try
+      {
+        throw;
+      }
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️[async] Coroutine failed\n\t{}", e.what());
+      }
+    }
+  };
+};
+
+inline void resume_on(boost::asio::io_service &io, std::coroutine_handle<> handle)
+{
+  io.post([handle]()
+          { handle.resume(); });
+}
+
+// co_await schedule(io): continue on one of the loop threads.
+inline auto schedule(boost::asio::io_service &io)
+{
+  struct Awaiter
+  {
+    boost::asio::io_service &io;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { resume_on(io, handle); }
+    void await_resume() const noexcept {}
+  };
+  return Awaiter{io};
+}
+
+inline auto sleep_until(boost::asio::io_service &io, std::chrono::steady_clock::time_point when)
+{
+  struct Awaiter
+  {
+    boost::asio::steady_timer timer;
+    bool await_ready() const { return timer.expiry() <= std::chrono::steady_clock::now(); }
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+      timer.async_wait([handle](const boost::system::error_code &)
+                       { handle.resume(); });
+    }
+    void await_resume() const noexcept {}
+  };
+  return Awaiter{boost::asio::steady_timer(io, when)};
+}
+
+inline auto sleep_for(boost::asio::io_service &io, std::chrono::steady_clock::duration delay)
+{
+  return sleep_until(io, std::chrono::steady_clock::now() + delay);
+}
+
+// Auto-reset event for a single waiting coroutine. set() from any thread
+// either resumes the waiter or is latched for its next wait(); a lone
+// exchange when nobody waits. The waiter re-checks its own condition, so
+// an early resume (e.g. a timeout racing a set()) is harmless.
+class AsyncEvent
+{
+public:
+  explicit AsyncEvent(boost::asio::io_service &io) : io_(io) {}
+
+  void set()
+  {
+    void *state = state_.load();
+    while (state != SET)
+    {
+      void *next = state == nullptr ? SET : nullptr;
+      if (state_.compare_exchange_weak(state, next))
+      {
+        if (state != nullptr)
+        {
+          resume_on(io_, std::coroutine_handle<>::from_address(state));
+        }
+        return;
+      }
+    }
+  }
+
+  bool is_set() const { return state_.load() == SET; }
+
+  auto wait() { return Awaiter{*this, std::nullopt}; }
+
+  // Also resumes once the deadline passes.
+  auto wait_until(std::chrono::steady_clock::time_point deadline) { return Awaiter{*this, deadline}; }
+
+private:
+  inline static char set_tag_;
+  inline static void *const SET = &set_tag_;
+
+  struct Awaiter
+  {
+    AsyncEvent &event;
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    std::optional<boost::asio::steady_timer> timer;
+
+    bool await_ready()
+    {
+      void *state = SET;
+      return event.state_.compare_exchange_strong(state, nullptr);
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+      // The timer is armed before the handle is published: from then on a
+      // set() on another thread may resume the coroutine, which destroys
+      // this awaiter, so only locals are touched past the publish.
+      std::shared_ptr<std::atomic<int>> phase;
+      if (deadline.has_value())
+      {
+        phase = std::make_shared<std::atomic<int>>(PENDING);
+        timer.emplace(event.io_, deadline.value());
+        timer->async_wait([&event = event, handle, phase](const boost::system::error_code &ec)
+                          {
+          if (!ec)
+            event.timeout(handle, phase); });
+      }
+      void *state = nullptr;
+      if (!event.state_.compare_exchange_strong(state, handle.address()))
+      {
+        event.state_.store(nullptr); // set() came in between, consume it
+        if (phase)
+        {
+          phase->store(ABANDONED);
+          timer->cancel();
+        }
+        return false;
+      }
+      if (phase)
+      {
+        phase->store(PUBLISHED);
+      }
+      return true;
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  // Where a wait_until() is, for its timer.
+  enum Phase
+  {
+    PENDING,   // handle not published yet
+    PUBLISHED, // waiting
+    ABANDONED, // did not suspend
+  };
+
+  // Resumes the waiter unless set() did. The timer may fire before the
+  // handle is published, it then tries again from the loop.
+  void timeout(std::coroutine_handle<> handle, std::shared_ptr<std::atomic<int>> phase)
+  {
+    int current = phase->load();
+    if (current == PENDING)
+    {
+      io_.post([this, handle, phase]()
+               { timeout(handle, phase); });
+      return;
+    }
+    void *waiting = handle.address();
+    if (current == PUBLISHED && state_.compare_exchange_strong(waiting, nullptr))
+    {
+      handle.resume();
+    }
+  }
+
+  boost::asio::io_service &io_;
+  std::atomic<void *> state_{nullptr};
+};
+
+// Unbounded queue drained by a single coroutine: co_await pop() suspends
+// while the queue is empty, push() from any thread resumes it.
+template <typename T>
+class AsyncQueue
+{
+public:
+  explicit AsyncQueue(boost::asio::io_service &io) : io_(io) {}
+
+  void push(T item)
+  {
+    std::coroutine_handle<> waiter;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(item));
+      std::swap(waiter, waiter_);
+    }
+    if (waiter)
+    {
+      resume_on(io_, waiter);
+    }
+  }
+
+  auto pop()
+  {
+    struct Awaiter
+    {
+      AsyncQueue &queue;
+
+      bool await_ready()
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+        return !queue.queue_.empty();
+      }
+
+      bool await_suspend(std::coroutine_handle<> handle)
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+        if (!queue.queue_.empty())
+        {
+          return false;
+        }
+        queue.waiter_ = handle;
+        return true;
+      }
+
+      T await_resume()
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex_);
+        T item = std::move(queue.queue_.front());
+        queue.queue_.pop_front();
+        return item;
+      }
+    };
+    return Awaiter{*this};
+  }
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+  }
+
+private:
+  boost::asio::io_service &io_;
+  std::mutex mutex_;
+  std::deque<T> queue_;
+  std::coroutine_handle<> waiter_;
+};
+
+#endif // ASYNC_H
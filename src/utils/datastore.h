@@ -3,18 +3,56 @@
 
 #include <map>
 #include <set>
+#include <array>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
 #include "kernels.h"
+#include "stats.h"
 
 using namespace std;
 
+// What profiling measured for one variant on one hardware platform, per
+// batch size. Loaded once, then shared read-only by every Model of it.
+struct ModelProfile
+{
+  string name;
+  string hardware_platform;
+  map<int, float> throughput;
+  map<int, unsigned long> memory;
+  map<int, std::vector<NcuKernel *>> kernels;
+
+  float throughput_at(int bs) const
+  {
+    auto it = throughput.find(bs);
+    return it != throughput.end() ? it->second : 0.0f;
+  }
+
+  unsigned long memory_at(int bs) const
+  {
+    auto it = memory.find(bs);
+    return it != memory.end() ? it->second : 0;
+  }
+
+  const std::vector<NcuKernel *> &kernels_at(int bs) const
+  {
+    static const std::vector<NcuKernel *> none;
+    auto it = kernels.find(bs);
+    return it != kernels.end() ? it->second : none;
+  }
+};
+
+// One variant instance (or a candidate for one): its batch size and
+// runtime counters, over a shared profile. Copies are a few words.
 class Model
 {
 private:
-  float achieved_throughput = 0.0;
-  map<int, float> map_throughput;
-  map<int, unsigned long> map_memory;
-  map<int, std::vector<NcuKernel *>> map_kernel;
+  Ewma achieved_throughput;
+  std::shared_ptr<const ModelProfile> profile_;
 
 public:
   int id;
@@ -26,18 +64,7 @@ public:
   int batch_size = 0;
   int model_memory = 0;
   int window_size = 10;
-  std::vector<int> input_rates = {
-      0,
-      0,
-      0,
-      0,
-      0,
-      0,
-      0,
-      0,
-      0,
-      0,
-  };
+  SlidingWindow<int, 10> input_rates; // queries received per second
 
   Model() {}
 
@@ -53,9 +80,8 @@ public:
     batch_size = model.batch_size;
     model_memory = model.model_memory;
     window_size = model.window_size;
-    map_throughput = model.map_throughput;
-    map_memory = model.map_memory;
-    map_kernel = model.map_kernel;
+    input_rates = model.input_rates;
+    profile_ = model.profile_;
   }
 
   Model(int id_, string name_, string hardware_platform_) : id(id_),
@@ -64,50 +90,32 @@ public:
   {
   }
 
-  std::vector<NcuKernel *> get_kernels(int bs = 0) const
-  {
-    if (bs == 0)
-      bs = batch_size;
-    auto it = map_kernel.find(bs);
-    if (it != map_kernel.end())
-      return it->second;
-    return std::vector<NcuKernel *>();
-  }
-
-  void set_kernels(vector<NcuKernel *> kernels, int batch_size)
-  {
-    map_kernel[batch_size] = kernels;
-  }
-
-  map<int, std::vector<NcuKernel *>> *get_Kernel()
+  Model(std::shared_ptr<const ModelProfile> profile, int batch_size_) : profile_(profile),
+                                                                       id(0),
+                                                                       name(profile->name),
+                                                                       hardware_platform(profile->hardware_platform),
+                                                                       batch_size(batch_size_)
   {
-    return &map_kernel;
   }
 
-  map<int, unsigned long> *get_Memory()
-  {
-    return &map_memory;
-  }
+  const std::shared_ptr<const ModelProfile> &get_profile() const { return profile_; }
 
-  map<int, float> *get_Throughput()
+  const std::vector<NcuKernel *> &get_kernels(int bs = 0) const
   {
-    return &map_throughput;
+    static const std::vector<NcuKernel *> none;
+    if (bs == 0)
+      bs = batch_size;
+    return profile_ ? profile_->kernels_at(bs) : none;
   }
 
-  float get_profile_throughput()
+  float get_profile_throughput() const
   {
-    return map_throughput[batch_size];
+    return profile_ ? profile_->throughput_at(batch_size) : 0.0f;
   }
 
-  float input_rate()
+  float input_rate() const
   {
-    int total = 0;
-    for (size_t i = 0; i < input_rates.size(); i++)
-    {
-      total += input_rates[i];
-    }
-    
-    return total / input_rates.size();
+    return input_rates.mean();
   }
 
   float initial_duration() const
@@ -119,41 +127,42 @@ public:
     return value;
   }
 
-  float get_throughput()
+  float get_throughput() const
   {
-    if (achieved_throughput > 0)
-      return achieved_throughput;
+    if (achieved_throughput.value() > 0)
+      return achieved_throughput.value();
     return get_profile_throughput();
   }
 
+  // As reported, e.g. by the worker running the variant.
   void set_throughput(float achieved_throughput_)
   {
-    achieved_throughput = achieved_throughput_;
+    achieved_throughput.set(achieved_throughput_);
   }
 
-  unsigned long get_memory(int bs = 0)
+  // One measurement, smoothed into the achieved throughput.
+  void record_throughput(float sample)
+  {
+    achieved_throughput.add(sample);
+  }
+
+  unsigned long get_memory(int bs = 0) const
   {
     if (bs == 0)
       bs = batch_size;
-    return map_memory[bs];
+    return profile_ ? profile_->memory_at(bs) : 0;
   }
 
-  float compute_workload()
+  float compute_workload() const
   {
     // Calculate the workload based on the current load and the previously recorded input rate.
-    int workload = qsize;
-    for (size_t i = 0; i < input_rates.size(); i++)
-    {
-      workload += input_rates[i];
-    }
-    
-    return workload;
+    return qsize + input_rates.sum();
   }
 
-  float compute_throughput()
+  float compute_throughput() const
   {
     // Calculate the throughput based on the window size of the previously recorded input rate.
-    return get_throughput() * input_rates.size();
+    return get_throughput() * input_rates.capacity();
   }
 
   void update(Model obj)
@@ -190,23 +199,16 @@ public:
   Worker(int id, int device = 0, string hardware_platform = "xavier")
       : id_(id), device_(device), hardware_platform_(hardware_platform), total_memory_(0.0) {}
 
+  // Memory of the running variants and of the reserved ones, both kept up
+  // to date as they come and go.
   float get_free_memory() const
   {
-    float total_variant_memory = 0.0f;
-    for (const auto &variant : variants_)
-    {
-      total_variant_memory += variant->get_memory();
-    }
-    return total_memory_ - total_variant_memory;
+    return total_memory_ - used_memory_ - reserved_memory_;
   }
 
   float percent_occupation(float additional = 0.0f) const
   {
-    float mem_used = additional;
-    for (const auto &variant : variants_)
-    {
-      mem_used += variant->get_memory();
-    }
+    float mem_used = additional + used_memory_ + reserved_memory_;
     return (mem_used / total_memory_) * 100.0f;
   }
 
@@ -216,12 +218,33 @@ public:
     {
       if (*running_variant == variant)
       {
+        used_memory_ -= running_variant->get_memory();
         running_variant->update(variant);
+        used_memory_ += running_variant->get_memory();
         return;
       }
     }
   }
 
+  // Ledger of the deployments sent and not acknowledged yet: their memory
+  // is taken until they run or are given up.
+  void reserve(int variant_id, unsigned long memory)
+  {
+    release(variant_id);
+    reservations_[variant_id] = memory;
+    reserved_memory_ += memory;
+  }
+
+  void release(int variant_id)
+  {
+    auto it = reservations_.find(variant_id);
+    if (it != reservations_.end())
+    {
+      reserved_memory_ -= it->second;
+      reservations_.erase(it);
+    }
+  }
+
   bool operator==(const Worker &other) const
   {
     return id_ == other.id_;
@@ -248,6 +271,17 @@ public:
 
   void add_variant(Model *variant) {
     variants_.push_back(variant);
+    used_memory_ += variant->get_memory();
+  }
+
+  void set_variants(std::vector<Model *> variants)
+  {
+    variants_ = std::move(variants);
+    used_memory_ = 0;
+    for (Model *variant : variants_)
+    {
+      used_memory_ += variant->get_memory();
+    }
   }
 
   void remove_variant(Model *variant)
@@ -256,6 +290,7 @@ public:
     {
       if (**it == *variant)
       {
+        used_memory_ -= (*it)->get_memory();
         variants_.erase(it);
         break;
       }
@@ -278,163 +313,357 @@ private:
   string device_name_;
   bool deploying_ = false;
   std::vector<Model *> variants_;
+  unsigned long used_memory_ = 0;
+  unsigned long reserved_memory_ = 0;
+  std::map<int, unsigned long> reservations_; // variant id -> memory
 };
 
-class DataStore
+// Read-only copy of the DataStore at one version: the workers with copies
+// of their variants, the registrations and an app index over them. It is
+// never changed once published, so readers (auto-scaler, schedulers) see a
+// consistent state without locking while updates go on. Workers that did
+// not change since the previous version share their copy with it.
+class DataSnapshot
 {
-private:
-  std::map<std::string, std::set<string>> registration_;
-  std::vector<Worker *> workers_;
-  std::mutex mutex_;
-
 public:
-  DataStore() {}
+  uint64_t get_version() const { return version_; }
 
-  std::map<std::string, std::set<string>> get_registration() const { return registration_; }
+  const std::vector<Worker *> &get_workers() const { return workers_; }
 
-  std::vector<Worker *> &get_workers()
+  const std::map<std::string, std::set<string>> &get_registration() const { return *registration_; }
+
+  std::set<string> get_registered(const string &app_id) const
   {
-    std::lock_guard<std::mutex> lock(mutex_);
-    return workers_;
+    auto it = registration_->find(app_id);
+    if (it != registration_->end())
+    {
+      return it->second;
+    }
+    return {};
   }
 
-  void register_app(const string &app_id, const string &variant_name)
+  std::vector<std::pair<Model *, Worker *>> get_variant_workers() const
   {
-    registration_[app_id].insert(variant_name);
+    std::vector<std::pair<Model *, Worker *>> variant_workers;
+    for (Worker *worker : workers_)
+    {
+      for (Model *variant : worker->get_variants())
+      {
+        variant_workers.emplace_back(variant, worker);
+      }
+    }
+    return variant_workers;
+  }
+
+  std::vector<std::pair<Model *, Worker *>> get_variant_workers(const std::string &app_id) const
+  {
+    std::vector<std::pair<Model *, Worker *>> variant_workers;
+    for (const auto &name : registration_->at(app_id))
+    {
+      auto it = name_index_.find(name);
+      if (it != name_index_.end())
+      {
+        variant_workers.insert(variant_workers.end(), it->second.begin(), it->second.end());
+      }
+    }
+    return variant_workers;
   }
 
-  std::map<std::string, std::set<string>> &get_registration()
+  std::vector<Model *> get_variants(const string &app_id) const
   {
-    return registration_;
+    std::vector<Model *> variants;
+    for (const auto &[variant, _] : get_variant_workers(app_id))
+    {
+      variants.push_back(variant);
+    }
+    return variants;
   }
 
-  std::set<string> get_registered(const string &app_id) const
+private:
+  friend class DataStore;
+
+  struct WorkerCopy
+  {
+    Worker worker;
+    std::vector<std::unique_ptr<Model>> variants;
+
+    explicit WorkerCopy(const Worker &live) : worker(live)
+    {
+      std::vector<Model *> copies;
+      for (Model *variant : live.get_variants())
+      {
+        auto &copy = variants.emplace_back(std::make_unique<Model>(*variant));
+        copies.push_back(copy.get());
+      }
+      worker.set_variants(std::move(copies));
+    }
+  };
+
+  uint64_t version_ = 0;
+  std::shared_ptr<const std::map<std::string, std::set<string>>> registration_ = std::make_shared<std::map<std::string, std::set<string>>>();
+  std::vector<std::shared_ptr<WorkerCopy>> copies_;
+  std::vector<Worker *> workers_;
+  std::unordered_map<std::string, std::vector<std::pair<Model *, Worker *>>> name_index_; // variant name -> instances
+};
+
+// Workers and the variant instances deployed on them. Writers change the
+// live objects under the store lock and publish a new DataSnapshot, once
+// per call; update() batches several changes into one version. Readers take
+// snapshot() and never lock. The live objects are only reached through the
+// writer side: hash lookups by worker id and variant id.
+class DataStore
+{
+private:
+  using Instance = std::pair<Model *, Worker *>;
+
+  std::map<std::string, std::set<string>> registration_;
+  std::vector<Worker *> workers_;
+  std::unordered_map<int, Worker *> worker_index_;
+  std::unordered_map<int, Instance> variant_index_;
+  // Reserved, waiting for DEPLOYED until the deadline.
+  struct Pending
+  {
+    Model *variant;
+    Worker *worker;
+    std::chrono::steady_clock::time_point deadline;
+  };
+  std::unordered_map<int, Pending> pending_;
+  std::set<int> dirty_; // workers changed since the last snapshot
+  bool registration_dirty_ = false;
+  std::atomic<std::shared_ptr<const DataSnapshot>> snapshot_{std::make_shared<const DataSnapshot>()};
+  std::mutex mutex_;
+
+  Worker *find_worker(int id)
   {
-    auto it = registration_.find(app_id);
-    if (it != registration_.end())
+    auto it = worker_index_.find(id);
+    if (it != worker_index_.end())
     {
       return it->second;
     }
-    return {};
+    throw std::runtime_error("❌No worker matches the given id " + std::to_string(id));
   }
 
-  std::vector<Model *> get_variants(const string &app_id)
+  // Under mutex_. Copies the changed workers only.
+  void publish()
   {
-    std::vector<Model *> variants;
-    for (auto &worker : get_workers())
+    auto previous = snapshot_.load();
+    auto next = std::make_shared<DataSnapshot>();
+    next->version_ = previous->version_ + 1;
+    next->registration_ = registration_dirty_ ? std::make_shared<const std::map<std::string, std::set<string>>>(registration_) : previous->registration_;
+    for (size_t i = 0; i < workers_.size(); i++)
     {
-      for (const auto &variant : worker->get_variants())
+      // Workers are only ever appended, positions match across versions.
+      bool reuse = i < previous->copies_.size() && dirty_.count(workers_[i]->get_id()) == 0;
+      next->copies_.push_back(reuse ? previous->copies_[i] : std::make_shared<DataSnapshot::WorkerCopy>(*workers_[i]));
+      Worker *worker = &next->copies_.back()->worker;
+      next->workers_.push_back(worker);
+      for (Model *variant : worker->get_variants())
       {
-        if (registration_.at(app_id).find(variant->name) != registration_.at(app_id).end())
-        {
-          variants.push_back(variant);
-        }
+        next->name_index_[variant->name].emplace_back(variant, worker);
       }
     }
-    return variants;
+    snapshot_.store(std::move(next));
+    dirty_.clear();
+    registration_dirty_ = false;
   }
 
-  std::vector<Model *> get_variants()
+public:
+  // Handed to update(). Every live object reached through it is copied
+  // again into the next snapshot.
+  class Writer
   {
-    std::vector<Model *> variants;
-    for (auto &worker : get_workers())
+  public:
+    Worker *worker(int id)
+    {
+      Worker *worker = store_.find_worker(id);
+      store_.dirty_.insert(id);
+      return worker;
+    }
+
+    // {nullptr, nullptr} if the variant is not deployed.
+    std::pair<Model *, Worker *> instance(int variant_id)
     {
-      for (const auto &variant : worker->get_variants())
+      auto it = store_.variant_index_.find(variant_id);
+      if (it == store_.variant_index_.end())
       {
-        variants.push_back(variant);
+        return {nullptr, nullptr};
       }
+      store_.dirty_.insert(it->second.second->get_id());
+      return it->second;
     }
-    return variants;
+
+  private:
+    friend class DataStore;
+    explicit Writer(DataStore &store) : store_(store) {}
+    DataStore &store_;
+  };
+
+  DataStore() {}
+
+  std::shared_ptr<const DataSnapshot> snapshot() const { return snapshot_.load(); }
+
+  // Applies a batch of changes under the store lock, published as one
+  // version.
+  template <typename Fn>
+  void update(Fn fn)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Writer writer(*this);
+    fn(writer);
+    publish();
+  }
+
+  void register_app(const string &app_id, const string &variant_name)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    registration_[app_id].insert(variant_name);
+    registration_dirty_ = true;
+    publish();
   }
 
   void register_worker(Worker *worker)
   {
+    std::lock_guard<std::mutex> lock(mutex_);
     workers_.push_back(worker);
+    worker_index_[worker->get_id()] = worker;
+    publish();
   }
 
   Worker *push(int id, Model *variant)
   {
-    for (auto &worker : get_workers())
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = worker_index_.find(id);
+    if (it == worker_index_.end())
     {
-      if (worker->get_id() != id)
-        continue;
-      worker->add_variant(variant);
-      return worker;
+      return nullptr;
     }
-    return nullptr;
-  }
-
-  void remove(int id, Model *variant)
+    Worker *worker = it->second;
+    worker->add_variant(variant);
+    variant_index_[variant->id] = {variant, worker};
+    dirty_.insert(id);
+    publish();
+    return worker;
+  }
+
+  // Reserves the memory of a variant about to be deployed, if the worker
+  // still has room for it next to what it runs and what is reserved.
+  // Checked and taken under the lock, so concurrent deployments decided on
+  // the same snapshot cannot overcommit a GPU. The variant joins the worker
+  // on commit(), cancel() gives the memory back; expired() lists the
+  // reservations still unacknowledged after the timeout.
+  bool reserve(int id, Model *variant, float max_occupancy,
+               std::chrono::steady_clock::duration timeout = std::chrono::minutes(2))
   {
     std::lock_guard<std::mutex> lock(mutex_);
-    for (auto &worker : workers_)
+    Worker *worker = find_worker(id);
+    if (worker->percent_occupation(variant->get_memory()) > max_occupancy)
     {
-      if (worker->get_id() != id)
-        continue;
-      worker->remove_variant(variant);
-      break;
+      return false;
     }
+    worker->reserve(variant->id, variant->get_memory());
+    pending_[variant->id] = {variant, worker, std::chrono::steady_clock::now() + timeout};
+    dirty_.insert(id);
+    publish();
+    return true;
   }
 
-  void update(Worker *worker)
+  // The deployment is acknowledged: the reservation becomes a variant of
+  // the worker. nullptr if nothing was reserved under that id.
+  Worker *commit(int variant_id)
   {
-    auto it = find(workers_.begin(), workers_.end(), worker);
-    if (it != workers_.end())
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pending_.find(variant_id);
+    if (it == pending_.end())
     {
-      int idx = distance(workers_.begin(), it);
-      for (auto &variant : worker->get_variants())
-      {
-        if (variant == nullptr)
-          continue;
-        workers_[idx]->set_total_memory(worker->get_total_memory());
-        workers_[idx]->update_variant(*variant);
-      }
+      return nullptr;
     }
-    else
+    auto [variant, worker, _] = it->second;
+    pending_.erase(it);
+    worker->release(variant_id);
+    worker->add_variant(variant);
+    variant_index_[variant_id] = {variant, worker};
+    dirty_.insert(worker->get_id());
+    publish();
+    return worker;
+  }
+
+  // The deployment failed or was given up on: the reservation is released.
+  // nullptr if nothing was reserved under that id.
+  Worker *cancel(int variant_id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = pending_.find(variant_id);
+    if (it == pending_.end())
     {
-      throw invalid_argument("Worker not found");
+      return nullptr;
     }
+    Worker *worker = it->second.worker;
+    pending_.erase(it);
+    worker->release(variant_id);
+    dirty_.insert(worker->get_id());
+    publish();
+    return worker;
   }
 
-  std::vector<std::pair<Model *, Worker *>> get_variant_workers()
+  // Variant ids of the reservations past their deadline, to cancel().
+  std::vector<int> expired(std::chrono::steady_clock::time_point now)
   {
-    static std::vector<std::pair<Model *, Worker *>> variant_workers;
-    for (auto &worker : get_workers())
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int> ids;
+    for (const auto &[variant_id, pending] : pending_)
     {
-      for (const auto &variant : worker->get_variants())
+      if (pending.deadline <= now)
       {
-        variant_workers.emplace_back(variant, worker);
+        ids.push_back(variant_id);
       }
     }
-    return variant_workers;
+    return ids;
   }
 
-  std::vector<std::pair<Model *, Worker *>> get_variant_workers(const std::string &app_id)
+  void remove(int id, Model *variant)
   {
-    std::vector<std::pair<Model *, Worker *>> variant_workers;
-    for (auto &worker : get_workers())
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = worker_index_.find(id);
+    if (it == worker_index_.end())
     {
-      for (const auto &variant : worker->get_variants())
-      {
-        if (registration_.at(app_id).find(variant->name) != registration_.at(app_id).end())
-        {
-          variant_workers.emplace_back(variant, worker);
-        }
-      }
+      return;
     }
-    return variant_workers;
+    it->second->remove_variant(variant);
+    auto instance = variant_index_.find(variant->id);
+    if (instance != variant_index_.end() && instance->second.second == it->second)
+    {
+      variant_index_.erase(instance);
+    }
+    dirty_.insert(id);
+    publish();
   }
 
-  Worker *get_worker(int id)
+  void update(Worker *worker)
   {
-    for (auto &worker : get_workers())
-    {
-      if (worker->get_id() == id)
+    update([&](Writer &store)
+           {
+      Worker *live = store.worker(worker->get_id());
+      for (auto &variant : worker->get_variants())
       {
-        return worker;
-      }
-    }
-    throw std::runtime_error("❌No worker matches the given id " + std::to_string(id));
+        if (variant == nullptr)
+          continue;
+        live->set_total_memory(worker->get_total_memory());
+        live->update_variant(*variant);
+      } });
+  }
+
+  // Live objects, for the writer side; their fields change under update().
+  std::pair<Model *, Worker *> get_variant_worker(int variant_id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = variant_index_.find(variant_id);
+    return it != variant_index_.end() ? it->second : Instance{nullptr, nullptr};
+  }
+
+  Worker *get_worker(int id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find_worker(id);
   }
 
   // friend ostream &operator<<(ostream &os, const DataStore &data_store)
@@ -2,6 +2,7 @@
 #define GENERAL_H
 
 #include <mutex>
+#include <atomic>
 #include <random>
 #include <algorithm>
 #include <stdexcept>
@@ -38,33 +39,21 @@ double median(const std::vector<double> &vec)
   }
 }
 
-class RandomGenerator
+// Engine-wide ids for workers and variant instances. Ids are handed out
+// in increasing order from `first` and never reused, so a late message
+// for a stopped variant cannot reach its successor; thread-safe.
+class IdAllocator
 {
 public:
-  RandomGenerator(int seed = 1234)
-      : engine_(seed), distribution_(999, 9999) {}
+  IdAllocator(int first = 1000) : next_(first) {}
 
   int next()
   {
-    while (true)
-    {
-      int value = distribution_(engine_);
-      if (used_values_.insert(value).second)
-      {
-        return value;
-      }
-    }
-  }
-
-  void remove(int value)
-  {
-    used_values_.erase(value);
+    return next_.fetch_add(1, std::memory_order_relaxed);
   }
 
 private:
-  std::mt19937 engine_;
-  std::uniform_int_distribution<int> distribution_;
-  std::unordered_set<int> used_values_;
+  std::atomic<int> next_;
 };
 
 class Event
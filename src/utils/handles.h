@@ -0,0 +1,133 @@
+#ifndef HANDLES_H
+#define HANDLES_H
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <shared_mutex>
+#include <unordered_map>
+
+// Dense handle -> T* table that may grow while it is read. Entries live in
+// fixed-size chunks that never move, so get() is two loads and no lock;
+// set() takes a mutex only to allocate a new chunk.
+template <typename T, size_t CHUNK_BITS = 10, size_t NUM_CHUNKS = 1024>
+class HandleTable
+{
+public:
+  static constexpr size_t CAPACITY = NUM_CHUNKS << CHUNK_BITS;
+
+  ~HandleTable()
+  {
+    for (auto &chunk : chunks_)
+    {
+      delete[] chunk.load();
+    }
+  }
+
+  T *get(uint32_t handle) const
+  {
+    if (handle >= CAPACITY)
+    {
+      return nullptr;
+    }
+    Slot *chunk = chunks_[handle >> CHUNK_BITS].load(std::memory_order_acquire);
+    return chunk == nullptr ? nullptr : chunk[handle & MASK].load(std::memory_order_acquire);
+  }
+
+  void set(uint32_t handle, T *value)
+  {
+    if (handle >= CAPACITY)
+    {
+      throw std::out_of_range("Handle " + std::to_string(handle) + " exceeds the table capacity");
+    }
+    auto &chunk = chunks_[handle >> CHUNK_BITS];
+    Slot *slots = chunk.load(std::memory_order_acquire);
+    if (slots == nullptr)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slots = chunk.load(std::memory_order_relaxed);
+      if (slots == nullptr)
+      {
+        slots = new Slot[size_t(1) << CHUNK_BITS]();
+        chunk.store(slots, std::memory_order_release);
+      }
+    }
+    slots[handle & MASK].store(value, std::memory_order_release);
+  }
+
+private:
+  using Slot = std::atomic<T *>;
+  static constexpr uint32_t MASK = (uint32_t(1) << CHUNK_BITS) - 1;
+
+  std::array<std::atomic<Slot *>, NUM_CHUNKS> chunks_{};
+  std::mutex mutex_;
+};
+
+// Interns names (e.g. app ids) into dense handles 0, 1, 2... allocated on
+// first sight. Lookups share a read lock and hash the name once; name()
+// goes the other way.
+class Interner
+{
+public:
+  uint32_t intern(std::string_view name)
+  {
+    if (auto handle = find(name))
+    {
+      return handle.value();
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    auto it = handles_.find(name);
+    if (it != handles_.end())
+    {
+      return it->second;
+    }
+    uint32_t handle = names_.size();
+    names_.emplace_back(name);
+    handles_.emplace(names_.back(), handle);
+    return handle;
+  }
+
+  std::optional<uint32_t> find(std::string_view name) const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = handles_.find(name);
+    if (it == handles_.end())
+    {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  // Names are never removed, the reference stays valid.
+  const std::string &name(uint32_t handle) const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return names_.at(handle);
+  }
+
+  size_t size() const
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return names_.size();
+  }
+
+private:
+  struct Hash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view name) const { return std::hash<std::string_view>()(name); }
+  };
+
+  mutable std::shared_mutex mutex_;
+  std::unordered_map<std::string_view, uint32_t, Hash, std::equal_to<>> handles_; // views into names_
+  std::deque<std::string> names_;
+};
+
+#endif // HANDLES_H
@@ -0,0 +1,93 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Log-linear histogram of durations in microseconds: 8 sub-buckets per
+// power of two, so percentiles are within ~6% of the true value, in
+// constant memory. record() is a relaxed increment, safe from any thread.
+class LatencyHistogram
+{
+public:
+  void record(uint64_t value)
+  {
+    buckets_[index(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  // Midpoint of the bucket holding the p-th percentile (0 < p <= 100).
+  uint64_t percentile(double p) const
+  {
+    uint64_t total = count();
+    if (total == 0)
+    {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+    rank = rank == 0 ? 1 : rank;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++)
+    {
+      seen += buckets_[i].load(std::memory_order_relaxed);
+      if (seen >= rank)
+      {
+        return midpoint(i);
+      }
+    }
+    return max_.load(std::memory_order_relaxed);
+  }
+
+  json summary() const
+  {
+    return {{"count", count()},
+            {"p50_us", percentile(50)},
+            {"p95_us", percentile(95)},
+            {"p99_us", percentile(99)},
+            {"max_us", max_.load(std::memory_order_relaxed)}};
+  }
+
+private:
+  static constexpr int SUB_BITS = 3;
+  static constexpr uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr size_t NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  static size_t index(uint64_t value)
+  {
+    if (value < SUB_BUCKETS)
+    {
+      return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    uint64_t sub = (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+  }
+
+  static uint64_t midpoint(size_t index)
+  {
+    if (index < SUB_BUCKETS)
+    {
+      return index;
+    }
+    int exponent = index / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    uint64_t width = uint64_t(1) << (exponent - SUB_BITS);
+    return (uint64_t(1) << exponent) + sub * width + width / 2;
+  }
+
+  std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+#endif // HISTOGRAM_H
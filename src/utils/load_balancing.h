@@ -3,149 +3,346 @@
 
 #include <string>
 #include <vector>
-// #include <numeric>
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <numeric>
+#include <cstdint>
 #include <optional>
-// #include <algorithm>
-#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+#include "handles.h"
 
+// How an app spreads its batches over its variant instances: weighted
+// round robin on the profiled weights, power of two choices on the work
+// each instance still has in flight, or the lowest predicted completion
+// time from the measured service times.
+enum class Routing
+{
+  WRR,
+  LEAST_OUTSTANDING,
+  LATENCY,
+};
+
+Routing string2routing(const std::string &name)
+{
+  if (name == "wrr")
+    return Routing::WRR;
+  if (name == "least_outstanding")
+    return Routing::LEAST_OUTSTANDING;
+  if (name == "latency")
+    return Routing::LATENCY;
+  throw std::invalid_argument("Unknown routing " + name);
+}
+
+class WeightedRoundRobinScheduling;
+
+// Where a forwarder stands in the routing of its app: the snapshot it
+// routes with, the rotation phase and the two-choice sampler. Each
+// forwarder owns one, so picks share no mutable state.
+struct RoutingCursor
+{
+  std::shared_ptr<const WeightedRoundRobinScheduling> table;
+  uint64_t version = 0;
+  uint64_t phase = 0;
+  uint64_t rng = 0x2545F4914F6CDD1Dull;
+
+  // Cheap xorshift, only spreads the two-choice samples.
+  uint64_t random()
+  {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+  }
+};
+
+// Weighted rotation over variant-instance handles in O(1) per pick. The
+// weights become an alias table (Vose): column c is kept with probability
+// threshold_[c], otherwise alias_[c] is picked. Instead of a random draw,
+// a golden-ratio (Weyl) sequence walks the table, so the picks are
+// deterministic and spread evenly: every window of picks matches the
+// weights closely, like smooth round robin. The table is immutable once
+// built; the sequence lives in the cursor, so a new table does not reset
+// the rotation.
 class WeightedRoundRobinScheduling
 {
 private:
-  std::vector<std::string> keys_;
-  std::unordered_map<std::string, int> weight_;
-  int n = 0;
-  int i = -1;
-  int cw = 0;
+  static constexpr uint64_t GOLDEN = 0x9E3779B97F4A7C15ull; // 2^64 / phi
+
+  std::vector<uint32_t> keys_;
+  std::vector<int> weights_;
+  std::vector<uint64_t> threshold_; // keep column c when the fraction is below
+  std::vector<uint32_t> alias_;     // index of the key picked otherwise
+  bool empty_ = true;               // no key, or all weights are zero
 
 public:
-  void set(const std::string &key, int w = 1)
+  WeightedRoundRobinScheduling(std::vector<uint32_t> keys, std::vector<int> weights)
+      : keys_(std::move(keys)), weights_(std::move(weights))
   {
-    auto it = std::find(keys_.begin(), keys_.end(), key);
-    if (it != keys_.end())
+    size_t n = keys_.size();
+    long total = 0;
+    for (int w : weights_)
+    {
+      total += std::max(w, 0);
+    }
+    threshold_.assign(n, UINT64_MAX);
+    alias_.resize(n);
+    empty_ = total <= 0;
+    if (empty_)
     {
-      update(key, w);
       return;
     }
-    keys_.push_back(key);
-    weight_[key] = w;
-    n = keys_.size();
-  }
-
-  void remove(const std::string &key)
-  {
-    keys_.erase(std::remove(keys_.begin(), keys_.end(), key), keys_.end());
-    weight_.erase(key);
-    n = keys_.size();
-  }
-
-  void update(const std::string &key, int w)
-  {
-    weight_[key] = w;
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for (size_t c = 0; c < n; c++)
+    {
+      alias_[c] = c;
+      scaled[c] = double(std::max(weights_[c], 0)) * n / total;
+      (scaled[c] < 1.0 ? small : large).push_back(c);
+    }
+    while (!small.empty() && !large.empty())
+    {
+      uint32_t s = small.back(), l = large.back();
+      small.pop_back();
+      double keep = std::ldexp(scaled[s], 64);
+      threshold_[s] = keep >= 0x1p64 ? UINT64_MAX : static_cast<uint64_t>(keep);
+      alias_[s] = l;
+      scaled[l] -= 1.0 - scaled[s];
+      if (scaled[l] < 1.0)
+      {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // Leftovers are 1.0 up to rounding, they keep their own column.
   }
 
-  std::optional<std::string> next()
+  std::optional<uint32_t> next(RoutingCursor &cursor) const
   {
     if (keys_.size() == 1)
       return keys_[0];
+    if (empty_)
+      return std::nullopt;
 
-    while (true)
-    {
-      i = (i + 1) % n;
-      if (i == 0)
-      {
-        // Compute GCD of all weight_s
-        int g = weight_[keys_[0]];
-        for (size_t k = 1; k < keys_.size(); ++k)
-        {
-          g = std::gcd(g, weight_[keys_[k]]);
-        }
-        cw -= g;
-
-        if (cw <= 0)
-        {
-          auto maxIt = std::max_element(keys_.begin(), keys_.end(),
-                                        [&](const std::string &a, const std::string &b)
-                                        {
-                                          return weight_[a] < weight_[b];
-                                        });
-          cw = weight_[*maxIt];
-          if (cw == 0)
-            return std::nullopt;
-        }
-      }
-
-      if (weight_[keys_[i]] >= cw)
-      {
-        return keys_[i];
-      }
-    }
+    cursor.phase += GOLDEN;
+    // High word of phase * n is the column, low word the fraction in it.
+    unsigned __int128 point = static_cast<unsigned __int128>(cursor.phase) * keys_.size();
+    uint32_t column = static_cast<uint32_t>(point >> 64);
+    return static_cast<uint64_t>(point) < threshold_[column] ? keys_[column] : keys_[alias_[column]];
   }
 
+  const std::vector<uint32_t> &keys() const { return keys_; }
+  const std::vector<int> &weights() const { return weights_; }
+
   std::string to_string() const
   {
     std::string data_format = "loadb -> [";
-    for (const auto key : keys_)
+    for (size_t k = 0; k < keys_.size(); k++)
     {
-      if (weight_.find(key) != weight_.end())
-      {
-        data_format += "'" + key + "': " + std::to_string(weight_.at(key)) + ", ";
-      }
-      else
-      {
-        data_format += "'" + key + "': null, ";
-      }
+      data_format += "'" + std::to_string(keys_[k]) + "': " + std::to_string(weights_[k]) + ", ";
     }
     data_format += "]";
     return data_format;
   }
 };
 
+// One routing table per app, indexed by the app handle. Tables are
+// immutable snapshots: writers build a new one and swap it in, forwarders
+// keep routing with the one in their cursor until they see the version
+// move. Picks never wait on a profile update and never see a half-updated
+// table; writers are serialized among themselves.
 class LoadBalancer
 {
 private:
-  std::unordered_map<std::string, WeightedRoundRobinScheduling> loadBalancer;
+  struct Entry
+  {
+    std::atomic<std::shared_ptr<const WeightedRoundRobinScheduling>> table;
+    std::atomic<uint64_t> version{0};
+  };
+
+  HandleTable<Entry> loadBalancer;
+  std::vector<std::unique_ptr<Entry>> entries_;
+  std::vector<uint32_t> apps_; // handles with a table, for to_string()
+  mutable std::mutex write_mutex_;
+
+  // Writers only, under write_mutex_.
+  Entry &entry(uint32_t app)
+  {
+    Entry *entry = loadBalancer.get(app);
+    if (entry == nullptr)
+    {
+      entry = entries_.emplace_back(std::make_unique<Entry>()).get();
+      loadBalancer.set(app, entry);
+      apps_.push_back(app);
+    }
+    return *entry;
+  }
+
+  void publish(Entry &entry, std::vector<uint32_t> keys, std::vector<int> weights)
+  {
+    entry.table.store(std::make_shared<const WeightedRoundRobinScheduling>(std::move(keys), std::move(weights)));
+    entry.version.fetch_add(1, std::memory_order_release);
+  }
+
+  // Refreshes the cursor's snapshot if a newer table was published.
+  const WeightedRoundRobinScheduling *snapshot(uint32_t app, RoutingCursor &cursor) const
+  {
+    Entry *entry = loadBalancer.get(app);
+    if (entry == nullptr)
+    {
+      return nullptr;
+    }
+    uint64_t version = entry->version.load(std::memory_order_acquire);
+    if (version != cursor.version || cursor.table == nullptr)
+    {
+      cursor.table = entry->table.load();
+      cursor.version = version;
+    }
+    return cursor.table.get();
+  }
 
 public:
-  void set(const std::string &app_id, const std::string &key, int w)
+  // Replaces the whole table of the app in one swap.
+  void assign(uint32_t app, std::vector<uint32_t> keys, std::vector<int> weights)
   {
-    loadBalancer[app_id].set(key, w);
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    publish(entry(app), std::move(keys), std::move(weights));
   }
 
-  void remove(const std::string &app_id, const std::string &key)
+  void set(uint32_t app, uint32_t key, int w)
   {
-    if (loadBalancer.count(app_id))
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    Entry &current = entry(app);
+    auto table = current.table.load();
+    std::vector<uint32_t> keys = table ? table->keys() : std::vector<uint32_t>();
+    std::vector<int> weights = table ? table->weights() : std::vector<int>();
+    auto it = std::find(keys.begin(), keys.end(), key);
+    if (it != keys.end())
+    {
+      weights[it - keys.begin()] = w;
+    }
+    else
     {
-      loadBalancer[app_id].remove(key);
+      keys.push_back(key);
+      weights.push_back(w);
     }
+    publish(current, std::move(keys), std::move(weights));
   }
 
-  void update(const std::string &app_id, const std::string &key, int w)
+  void update(uint32_t app, uint32_t key, int w)
   {
-    if (loadBalancer.count(app_id))
     {
-      loadBalancer[app_id].update(key, w);
+      std::lock_guard<std::mutex> lock(write_mutex_);
+      Entry *current = loadBalancer.get(app);
+      auto table = current ? current->table.load() : nullptr;
+      if (!table || std::find(table->keys().begin(), table->keys().end(), key) == table->keys().end())
+      {
+        return;
+      }
     }
+    set(app, key, w);
   }
 
-  std::optional<std::string> next(const std::string &app_id)
+  void remove(uint32_t app, uint32_t key)
   {
-    if (loadBalancer.count(app_id))
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    Entry *current = loadBalancer.get(app);
+    auto table = current ? current->table.load() : nullptr;
+    if (!table)
     {
-      return loadBalancer[app_id].next();
+      return;
+    }
+    std::vector<uint32_t> keys = table->keys();
+    std::vector<int> weights = table->weights();
+    auto it = std::find(keys.begin(), keys.end(), key);
+    if (it != keys.end())
+    {
+      weights.erase(weights.begin() + (it - keys.begin()));
+      keys.erase(it);
+      publish(*current, std::move(keys), std::move(weights));
+    }
+  }
+
+  std::optional<uint32_t> next(uint32_t app, RoutingCursor &cursor) const
+  {
+    if (auto table = snapshot(app, cursor))
+    {
+      return table->next(cursor);
     }
     return std::nullopt;
   }
 
+  // Power of two choices: of two distinct candidates drawn at random, the
+  // one with the lower cost(key). Zero-weight keys are left out.
+  template <typename Cost>
+  std::optional<uint32_t> next_least(uint32_t app, RoutingCursor &cursor, Cost cost) const
+  {
+    const WeightedRoundRobinScheduling *table = snapshot(app, cursor);
+    if (table == nullptr || table->keys().empty())
+    {
+      return std::nullopt;
+    }
+    const auto &keys = table->keys();
+    const auto &weights = table->weights();
+    size_t n = keys.size();
+    if (n == 1)
+    {
+      return keys[0];
+    }
+    size_t a = cursor.random() % n;
+    size_t b = (a + 1 + cursor.random() % (n - 1)) % n;
+    if (weights[a] <= 0 && weights[b] <= 0)
+    {
+      return table->next(cursor);
+    }
+    if (weights[a] <= 0)
+      return keys[b];
+    if (weights[b] <= 0)
+      return keys[a];
+    return cost(keys[a]) <= cost(keys[b]) ? keys[a] : keys[b];
+  }
+
+  // The candidate with the lowest cost(key), zero-weight keys left out.
+  template <typename Cost>
+  std::optional<uint32_t> next_min(uint32_t app, RoutingCursor &cursor, Cost cost) const
+  {
+    const WeightedRoundRobinScheduling *table = snapshot(app, cursor);
+    if (table == nullptr)
+    {
+      return std::nullopt;
+    }
+    const auto &keys = table->keys();
+    const auto &weights = table->weights();
+    std::optional<uint32_t> best;
+    double best_cost = 0;
+    for (size_t k = 0; k < keys.size(); k++)
+    {
+      if (weights[k] <= 0)
+        continue;
+      double c = cost(keys[k]);
+      if (!best.has_value() || c < best_cost)
+      {
+        best = keys[k];
+        best_cost = c;
+      }
+    }
+    return best.has_value() ? best : table->next(cursor);
+  }
+
   std::string to_string() const
   {
+    std::lock_guard<std::mutex> lock(write_mutex_);
     std::string data_format = "LoadBalancing(";
-    for (auto &[app_id, loadb] : loadBalancer)
+    for (uint32_t app : apps_)
     {
-      data_format += "\n\t'" + app_id + "': " + loadb.to_string();
+      auto table = loadBalancer.get(app)->table.load();
+      data_format += "\n\t'" + std::to_string(app) + "': " + (table ? table->to_string() : "null");
     }
     data_format += ")";
     return data_format;
   }
 };
 
-#endif // LOAD_BALANCING_H
\ No newline at end of file
+#endif // LOAD_BALANCING_H
@@ -38,9 +38,9 @@ double convert(const std::string &v)
 }
 
 // Function to read CSV file
-void set_profiled_kernels(Model &model, std::string data_path = "data/traces")
+void set_profiled_kernels(ModelProfile &profile, std::string data_path = "data/traces")
 {
-    std::string fullpath = WORKDIR + "/" + data_path + "/nsight-compute/xavier/" + model.name + "_preprocessed_ncu.json";
+    std::string fullpath = WORKDIR + "/" + data_path + "/nsight-compute/xavier/" + profile.name + "_preprocessed_ncu.json";
     json j;
     try
     {
@@ -87,7 +87,7 @@ void set_profiled_kernels(Model &model, std::string data_path = "data/traces")
             kernel->capability_major = k["capability_major"];
             kernels.push_back(kernel);
         }
-        (*model.get_Kernel())[item["batch_size"]] = kernels;
+        profile.kernels[item["batch_size"]] = kernels;
     }
 }
 
@@ -136,11 +136,15 @@ void set_throughput(map<int, float> &Throughput, const std::string &variant_name
     }
 }
 
-void pre_profiled(Model &model)
+std::shared_ptr<const ModelProfile> pre_profiled(const std::string &variant_name, const std::string &hardware_platform)
 {
-    set_profiled_kernels(model);
-    set_memory(*(model.get_Memory()), model.name, model.hardware_platform);
-    set_throughput(*(model.get_Throughput()), model.name, model.hardware_platform);
+    auto profile = std::make_shared<ModelProfile>();
+    profile->name = variant_name;
+    profile->hardware_platform = hardware_platform;
+    set_profiled_kernels(*profile);
+    set_memory(profile->memory, variant_name, hardware_platform);
+    set_throughput(profile->throughput, variant_name, hardware_platform);
+    return profile;
 }
 
 #endif // PROFILER_H
\ No newline at end of file
@@ -4,23 +4,79 @@
 
 #include <queue>
 #include <mutex>
+#include <chrono>
 #include <atomic>
+#include <string>
 #include <vector>
+#include <stdexcept>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+#include <ctime>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <condition_variable>
 
+// What a bounded queue does with a push when it is full.
+enum class OverflowPolicy
+{
+  BLOCK,       // wait for room
+  DROP_OLDEST, // evict the head to make room
+  REJECT,      // drop the new item, push() returns false
+};
+
+OverflowPolicy string2overflow(const std::string &name)
+{
+  if (name == "block")
+    return OverflowPolicy::BLOCK;
+  if (name == "drop_oldest")
+    return OverflowPolicy::DROP_OLDEST;
+  if (name == "reject")
+    return OverflowPolicy::REJECT;
+  throw std::invalid_argument("Unknown overflow policy " + name);
+}
+
+// Mutex/condition-variable queue. A capacity of zero leaves it unbounded,
+// otherwise the overflow policy applies; dropped() counts the items lost to
+// DROP_OLDEST or REJECT.
 template <typename T>
 class BlockingQueue
 {
 public:
+  BlockingQueue(size_t capacity = 0, OverflowPolicy policy = OverflowPolicy::BLOCK)
+      : capacity_(capacity), policy_(policy) {}
+
   // Push an item into the queue
-  void push(const T &item)
+  bool push(const T &item)
   {
     {
-      std::lock_guard<std::mutex> lock(mutex_);
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!make_room(lock))
+      {
+        return false;
+      }
       queue_.push(item);
     }
     cond_var_.notify_one(); // Wake up one waiting thread
+    return true;
+  }
+
+  bool push(T &&item)
+  {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!make_room(lock))
+      {
+        return false;
+      }
+      queue_.push(std::move(item));
+    }
+    cond_var_.notify_one();
+    return true;
   }
 
   // Pop an item from the queue (blocks if empty)
@@ -30,11 +86,72 @@ public:
     cond_var_.wait(lock, [this]()
                    { return !queue_.empty(); });
 
-    T item = queue_.front();
+    T item = std::move(queue_.front());
     queue_.pop();
+    popped(lock);
     return item;
   }
 
+  // Pop an item, waiting at most until the deadline. Returns false on timeout
+  // (a deadline in the past makes it a non-blocking try).
+  template <typename Clock, typename Duration>
+  bool pop_until(T &item, const std::chrono::time_point<Clock, Duration> &deadline)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!cond_var_.wait_until(lock, deadline, [this]()
+                              { return !queue_.empty(); }))
+    {
+      return false;
+    }
+    item = std::move(queue_.front());
+    queue_.pop();
+    popped(lock);
+    return true;
+  }
+
+  // Pop an item if one is queued, never blocks.
+  bool try_pop(T &item)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (queue_.empty())
+    {
+      return false;
+    }
+    item = std::move(queue_.front());
+    queue_.pop();
+    popped(lock);
+    return true;
+  }
+
+  // Move up to max items into out (push_back) under one lock acquisition,
+  // never blocks. Returns how many were moved.
+  template <typename Container>
+  size_t try_drain_into(Container &out, size_t max = SIZE_MAX)
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t count = take(out, max);
+    if (count > 0)
+    {
+      popped(lock);
+    }
+    return count;
+  }
+
+  // Move exactly n items into out, blocking until they are all there; each
+  // wakeup takes whatever is queued in one go.
+  template <typename Container>
+  void pop_n(Container &out, size_t n)
+  {
+    while (n > 0)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_var_.wait(lock, [this]()
+                     { return !queue_.empty(); });
+      n -= take(out, n);
+      popped(lock);
+    }
+  }
+
   // Optional: Check size (non-blocking)
   size_t size() const
   {
@@ -42,62 +159,636 @@ public:
     return queue_.size();
   }
 
+  size_t capacity() const { return capacity_; }
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
 private:
+  // Called with the lock held, false when the item must not be queued.
+  bool make_room(std::unique_lock<std::mutex> &lock)
+  {
+    if (capacity_ == 0 || queue_.size() < capacity_)
+    {
+      return true;
+    }
+    switch (policy_)
+    {
+    case OverflowPolicy::BLOCK:
+      not_full_.wait(lock, [this]()
+                     { return queue_.size() < capacity_; });
+      return true;
+    case OverflowPolicy::DROP_OLDEST:
+      queue_.pop();
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    default:
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+
+  template <typename Container>
+  size_t take(Container &out, size_t max)
+  {
+    size_t count = 0;
+    while (count < max && !queue_.empty())
+    {
+      out.push_back(std::move(queue_.front()));
+      queue_.pop();
+      count++;
+    }
+    return count;
+  }
+
+  void popped(std::unique_lock<std::mutex> &lock)
+  {
+    if (capacity_ > 0 && policy_ == OverflowPolicy::BLOCK)
+    {
+      lock.unlock();
+      not_full_.notify_all();
+    }
+  }
+
   std::queue<T> queue_;
   mutable std::mutex mutex_;
   std::condition_variable cond_var_;
+  std::condition_variable not_full_;
+  size_t capacity_;
+  OverflowPolicy policy_;
+  std::atomic<size_t> dropped_{0};
 };
 
+// Futex event count, the parking half of the lock-free queues: a waiter
+// announces itself, re-checks its condition, then sleeps only if no notify
+// happened in between. notify() costs a fence and a load while nobody sleeps.
+class EventCount
+{
+public:
+  uint32_t prepare_wait()
+  {
+    waiters_.fetch_add(1, std::memory_order_seq_cst);
+    return epoch_.load(std::memory_order_seq_cst);
+  }
+
+  void cancel_wait()
+  {
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  void wait(uint32_t key)
+  {
+    futex(FUTEX_WAIT_PRIVATE, key, nullptr);
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // False once the deadline passed.
+  template <typename Clock, typename Duration>
+  bool wait_until(uint32_t key, const std::chrono::time_point<Clock, Duration> &deadline)
+  {
+    auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - Clock::now());
+    if (remaining.count() > 0)
+    {
+      timespec timeout{static_cast<time_t>(remaining.count() / 1000000000), static_cast<long>(remaining.count() % 1000000000)};
+      futex(FUTEX_WAIT_PRIVATE, key, &timeout);
+    }
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return Clock::now() < deadline;
+  }
+
+  void notify_one() { notify(1); }
+  void notify_all() { notify(INT_MAX); }
+
+private:
+  void notify(int count)
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) == 0)
+    {
+      return;
+    }
+    epoch_.fetch_add(1, std::memory_order_seq_cst);
+    futex(FUTEX_WAKE_PRIVATE, count, nullptr);
+  }
+
+  void futex(int op, uint32_t value, const timespec *timeout)
+  {
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch_), op, value, timeout, nullptr, 0);
+  }
+
+  std::atomic<uint32_t> epoch_{0};
+  std::atomic<uint32_t> waiters_{0};
+};
+
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring:
+// each cell carries a sequence number saying whether it is free for the
+// producer or ready for the consumer of a given position). Same interface
+// as BlockingQueue so a use site can pick either; the capacity is rounded
+// up to a power of two and cannot be unbounded (0 picks DEFAULT_CAPACITY).
+// Blocking calls spin briefly, then park on a futex.
 template <typename T>
-class HybridSPSCQueue
+class MPMCQueue
 {
 public:
-  HybridSPSCQueue(size_t capacity)
-      : buffer_(capacity), capacity_(capacity), head_(0), tail_(0) {}
+  static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
 
-  void push(const T &item)
+  MPMCQueue(size_t capacity = 0, OverflowPolicy policy = OverflowPolicy::BLOCK)
+      : policy_(policy)
   {
-    size_t next_tail = (tail_ + 1) % capacity_;
-    if (next_tail == head_.load(std::memory_order_acquire))
+    size_t size = 2;
+    while (size < (capacity == 0 ? DEFAULT_CAPACITY : capacity))
     {
-      throw std::runtime_error("Queue overflow"); // Or resize if needed
+      size <<= 1;
     }
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; i++)
+    {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
 
-    buffer_[tail_] = item;
-    tail_ = next_tail;
+  ~MPMCQueue()
+  {
+    T item;
+    while (try_pop(item))
+    {
+    }
+  }
 
-    // Notify consumer if it was waiting
-    std::lock_guard<std::mutex> lock(mutex_);
-    cond_var_.notify_one();
+  MPMCQueue(const MPMCQueue &) = delete;
+  MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+  bool push(const T &item) { return push_impl(item); }
+  bool push(T &&item) { return push_impl(std::move(item)); }
+
+  T pop()
+  {
+    T item;
+    while (!try_pop(item))
+    {
+      if (spin([&]()
+               { return try_pop(item); }))
+      {
+        break;
+      }
+      uint32_t key = not_empty_.prepare_wait();
+      if (try_pop(item))
+      {
+        not_empty_.cancel_wait();
+        break;
+      }
+      not_empty_.wait(key);
+    }
+    return item;
+  }
+
+  template <typename Clock, typename Duration>
+  bool pop_until(T &item, const std::chrono::time_point<Clock, Duration> &deadline)
+  {
+    while (!try_pop(item))
+    {
+      if (spin([&]()
+               { return try_pop(item); }))
+      {
+        return true;
+      }
+      uint32_t key = not_empty_.prepare_wait();
+      if (try_pop(item))
+      {
+        not_empty_.cancel_wait();
+        return true;
+      }
+      if (!not_empty_.wait_until(key, deadline))
+      {
+        return try_pop(item);
+      }
+    }
+    return true;
   }
 
-  T pop_blocking()
+  bool try_pop(T &item)
   {
+    Cell *cell;
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
     while (true)
     {
-      if (head_.load(std::memory_order_acquire) != tail_)
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0)
       {
-        T item = buffer_[head_];
-        head_ = (head_ + 1) % capacity_;
-        return item;
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
       }
+      else if (diff < 0)
+      {
+        return false; // empty
+      }
+      else
+      {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    T *value = cell->value();
+    item = std::move(*value);
+    value->~T();
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    if (policy_ == OverflowPolicy::BLOCK)
+    {
+      not_full_.notify_one();
+    }
+    return true;
+  }
 
-      // Wait until producer pushes something
-      std::unique_lock<std::mutex> lock(mutex_);
-      cond_var_.wait(lock, [this]()
-                     { return head_.load(std::memory_order_acquire) != tail_; });
+  // Claim the run of ready cells at the head with a single CAS and move up
+  // to max of them into out (push_back). Never blocks.
+  template <typename Container>
+  size_t try_drain_into(Container &out, size_t max = SIZE_MAX)
+  {
+    if (max == 0)
+    {
+      return 0;
+    }
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    size_t count;
+    while (true)
+    {
+      count = 0;
+      while (count < max && count <= mask_ &&
+             cells_[(pos + count) & mask_].sequence.load(std::memory_order_acquire) == pos + count + 1)
+      {
+        count++;
+      }
+      if (count == 0)
+      {
+        size_t sequence = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1) < 0)
+          return 0; // empty
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+        break;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      Cell &cell = cells_[(pos + i) & mask_];
+      T *value = cell.value();
+      out.push_back(std::move(*value));
+      value->~T();
+      cell.sequence.store(pos + i + mask_ + 1, std::memory_order_release);
+    }
+    if (policy_ == OverflowPolicy::BLOCK)
+    {
+      not_full_.notify_all();
+    }
+    return count;
+  }
+
+  // Move exactly n items into out, blocking (spin, then park) until they
+  // are all there.
+  template <typename Container>
+  void pop_n(Container &out, size_t n)
+  {
+    while (true)
+    {
+      n -= try_drain_into(out, n);
+      if (n == 0 || spin([&]()
+                         { return (n -= try_drain_into(out, n)) == 0; }))
+      {
+        return;
+      }
+      uint32_t key = not_empty_.prepare_wait();
+      if (size() > 0)
+      {
+        not_empty_.cancel_wait();
+        continue;
+      }
+      not_empty_.wait(key);
     }
   }
 
+  // Approximate while producers or consumers are active.
+  size_t size() const
+  {
+    size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+    size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+  size_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
 private:
-  std::vector<T> buffer_;
-  const size_t capacity_;
-  std::atomic<size_t> head_;
-  size_t tail_; // Only producer writes to tail
+  struct alignas(64) Cell
+  {
+    std::atomic<size_t> sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
 
-  std::mutex mutex_;
-  std::condition_variable cond_var_;
+    T *value() { return std::launder(reinterpret_cast<T *>(&storage)); }
+  };
+
+  static constexpr int SPIN = 1000;
+
+  template <typename Ready>
+  static bool spin(Ready ready)
+  {
+    for (int i = 0; i < SPIN; i++)
+    {
+      if (ready())
+        return true;
+    }
+    return false;
+  }
+
+  template <typename U>
+  bool try_push(U &&item)
+  {
+    Cell *cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true)
+    {
+      cell = &cells_[pos & mask_];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0)
+      {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if (diff < 0)
+      {
+        return false; // full
+      }
+      else
+      {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    new (&cell->storage) T(std::forward<U>(item));
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    not_empty_.notify_one();
+    return true;
+  }
+
+  template <typename U>
+  bool push_impl(U &&item)
+  {
+    while (!try_push(std::forward<U>(item)))
+    {
+      switch (policy_)
+      {
+      case OverflowPolicy::BLOCK:
+      {
+        if (spin([this]()
+                 { return size() <= mask_; }))
+        {
+          continue;
+        }
+        uint32_t key = not_full_.prepare_wait();
+        if (size() <= mask_)
+        {
+          not_full_.cancel_wait();
+          continue;
+        }
+        not_full_.wait(key);
+        break;
+      }
+      case OverflowPolicy::DROP_OLDEST:
+      {
+        T oldest;
+        if (try_pop(oldest))
+        {
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        break;
+      }
+      default:
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  alignas(64) std::atomic<size_t> dequeue_pos_{0};
+  alignas(64) std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  OverflowPolicy policy_;
+  std::atomic<size_t> dropped_{0};
+  EventCount not_empty_;
+  EventCount not_full_;
 };
 
+// Bounded single-producer/single-consumer ring, wait-free on both ends
+// while neither full nor empty. Each side keeps a cached copy of the other
+// side's index on its own cache line and only reloads it when the ring looks
+// full (producer) or empty (consumer). Blocking calls spin briefly, then park
+// on a futex; a push only pays a syscall when the consumer is parked.
+// Producer calls must not overlap (consecutive producers must be ordered,
+// e.g. run by one strand), likewise for the consumer.
+template <typename T>
+class HybridSPSCQueue
+{
+public:
+  HybridSPSCQueue(size_t capacity)
+  {
+    size_t size = 2;
+    while (size < capacity)
+    {
+      size <<= 1;
+    }
+    buffer_.resize(size);
+    mask_ = size - 1;
+  }
+
+  HybridSPSCQueue(const HybridSPSCQueue &) = delete;
+  HybridSPSCQueue &operator=(const HybridSPSCQueue &) = delete;
+
+  bool try_push(const T &item) { return try_push_impl(item); }
+  bool try_push(T &&item) { return try_push_impl(std::move(item)); }
+
+  // Blocks while the ring is full.
+  void push(const T &item) { push_impl(item); }
+  void push(T &&item) { push_impl(std::move(item)); }
+
+  bool try_pop(T &item)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail_)
+    {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail_)
+      {
+        return false;
+      }
+    }
+    item = std::move(buffer_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Blocks while the ring is empty.
+  T pop()
+  {
+    T item;
+    while (!try_pop(item))
+    {
+      if (spin([&]()
+               { return try_pop(item); }))
+      {
+        break;
+      }
+      uint32_t key = not_empty_.prepare_wait();
+      if (try_pop(item))
+      {
+        not_empty_.cancel_wait();
+        break;
+      }
+      not_empty_.wait(key);
+    }
+    return item;
+  }
+
+  template <typename Clock, typename Duration>
+  bool pop_until(T &item, const std::chrono::time_point<Clock, Duration> &deadline)
+  {
+    while (!try_pop(item))
+    {
+      if (spin([&]()
+               { return try_pop(item); }))
+      {
+        return true;
+      }
+      uint32_t key = not_empty_.prepare_wait();
+      if (try_pop(item))
+      {
+        not_empty_.cancel_wait();
+        return true;
+      }
+      if (!not_empty_.wait_until(key, deadline))
+      {
+        return try_pop(item);
+      }
+    }
+    return true;
+  }
+
+  // Move up to max items into out (push_back) with one index update.
+  template <typename Container>
+  size_t try_drain_into(Container &out, size_t max = SIZE_MAX)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    cached_tail_ = tail_.load(std::memory_order_acquire);
+    size_t count = std::min(cached_tail_ - head, max);
+    for (size_t i = 0; i < count; i++)
+    {
+      out.push_back(std::move(buffer_[(head + i) & mask_]));
+    }
+    if (count > 0)
+    {
+      head_.store(head + count, std::memory_order_release);
+      not_full_.notify_one();
+    }
+    return count;
+  }
+
+  // Move exactly n items into out, blocking (spin, then park) until they
+  // are all there.
+  template <typename Container>
+  void pop_n(Container &out, size_t n)
+  {
+    while (true)
+    {
+      n -= try_drain_into(out, n);
+      if (n == 0 || spin([&]()
+                         { return (n -= try_drain_into(out, n)) == 0; }))
+      {
+        return;
+      }
+      uint32_t key = not_empty_.prepare_wait();
+      if (size() > 0)
+      {
+        not_empty_.cancel_wait();
+        continue;
+      }
+      not_empty_.wait(key);
+    }
+  }
+
+  size_t size() const
+  {
+    size_t tail = tail_.load(std::memory_order_acquire);
+    size_t head = head_.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  static constexpr int SPIN = 1000;
+
+  template <typename Ready>
+  static bool spin(Ready ready)
+  {
+    for (int i = 0; i < SPIN; i++)
+    {
+      if (ready())
+        return true;
+    }
+    return false;
+  }
+
+  template <typename U>
+  bool try_push_impl(U &&item)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head_ > mask_)
+    {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if (tail - cached_head_ > mask_)
+      {
+        return false;
+      }
+    }
+    buffer_[tail & mask_] = std::forward<U>(item);
+    tail_.store(tail + 1, std::memory_order_release);
+    not_empty_.notify_one();
+    return true;
+  }
+
+  template <typename U>
+  void push_impl(U &&item)
+  {
+    while (!try_push_impl(std::forward<U>(item)))
+    {
+      if (spin([this]()
+               { return size() <= mask_; }))
+      {
+        continue;
+      }
+      uint32_t key = not_full_.prepare_wait();
+      if (size() <= mask_)
+      {
+        not_full_.cancel_wait();
+        continue;
+      }
+      not_full_.wait(key);
+    }
+  }
+
+  // Consumer line
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail_ = 0;
+  EventCount not_full_;
+  // Producer line
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head_ = 0;
+  EventCount not_empty_;
+  // Shared, read-only after construction
+  alignas(64) std::vector<T> buffer_;
+  size_t mask_;
+};
 
 #endif // QUEUE_H
\ No newline at end of file
@@ -0,0 +1,177 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+// Exponentially weighted moving average; the first sample seeds it.
+class Ewma
+{
+public:
+  explicit Ewma(double alpha = 0.2) : alpha_(alpha) {}
+
+  void add(double sample)
+  {
+    value_ = seen_ ? value_ + alpha_ * (sample - value_) : sample;
+    seen_ = true;
+  }
+
+  // Overrides the average, e.g. with one computed elsewhere.
+  void set(double value)
+  {
+    value_ = value;
+    seen_ = true;
+  }
+
+  double value() const { return value_; }
+  bool empty() const { return !seen_; }
+
+private:
+  double alpha_;
+  double value_ = 0.0;
+  bool seen_ = false;
+};
+
+// The last N samples (e.g. one per second) in a ring buffer. The sum is
+// kept as samples come and go, min/max by monotonic queues over the same
+// ring, so push() and every query are O(1) (amortized for push()). Slots
+// never pushed count as zero in the sum and the mean, not in min/max.
+template <typename T, size_t N>
+class SlidingWindow
+{
+  static_assert(N > 0, "empty window");
+
+public:
+  void push(T sample)
+  {
+    uint64_t seq = pushed_++;
+    // The slot about to be overwritten leaves the window first.
+    if (seq >= N)
+    {
+      sum_ -= ring_[seq % N];
+      expire(min_, seq - N);
+      expire(max_, seq - N);
+    }
+    ring_[seq % N] = sample;
+    sum_ += sample;
+    enqueue(min_, seq, [](T a, T b)
+            { return a >= b; });
+    enqueue(max_, seq, [](T a, T b)
+            { return a <= b; });
+  }
+
+  // Replaces the content, newest sample first (the order of values()).
+  template <typename Samples>
+  void assign(const Samples &samples)
+  {
+    *this = SlidingWindow();
+    size_t n = std::min<size_t>(samples.size(), N);
+    for (size_t i = n; i > 0; i--)
+    {
+      push(samples[i - 1]);
+    }
+  }
+
+  T sum() const { return sum_; }
+  double mean() const { return static_cast<double>(sum_) / N; }
+  T last() const { return pushed_ == 0 ? T() : ring_[(pushed_ - 1) % N]; }
+  T min() const { return min_.size == 0 ? T() : ring_[min_.front() % N]; }
+  T max() const { return max_.size == 0 ? T() : ring_[max_.front() % N]; }
+  size_t count() const { return std::min<uint64_t>(pushed_, N); }
+  static constexpr size_t capacity() { return N; }
+
+  // Newest first, N entries.
+  std::vector<T> values() const
+  {
+    std::vector<T> values(N, T());
+    for (size_t i = 0; i < count(); i++)
+    {
+      values[i] = ring_[(pushed_ - 1 - i) % N];
+    }
+    return values;
+  }
+
+private:
+  // Deque of sample sequence numbers in a fixed ring; never more than N.
+  struct Queue
+  {
+    std::array<uint64_t, N> seqs{};
+    size_t head = 0;
+    size_t size = 0;
+
+    uint64_t front() const { return seqs[head]; }
+    uint64_t back() const { return seqs[(head + size - 1) % N]; }
+  };
+
+  static void expire(Queue &queue, uint64_t seq)
+  {
+    if (queue.size > 0 && queue.front() == seq)
+    {
+      queue.head = (queue.head + 1) % N;
+      queue.size--;
+    }
+  }
+
+  // Drops the samples the new one dominates, they can no longer be the
+  // min (resp. max) of any window still to come.
+  template <typename Dominated>
+  void enqueue(Queue &queue, uint64_t seq, Dominated dominated)
+  {
+    while (queue.size > 0 && dominated(ring_[queue.back() % N], ring_[seq % N]))
+    {
+      queue.size--;
+    }
+    queue.seqs[(queue.head + queue.size) % N] = seq;
+    queue.size++;
+  }
+
+  std::array<T, N> ring_{};
+  T sum_ = T();
+  uint64_t pushed_ = 0;
+  Queue min_;
+  Queue max_;
+};
+
+// One sample per interval (e.g. arrivals or queue depth every second) seen
+// at three resolutions: the last interval, the last 10 and the last 60,
+// plus an EWMA. O(1) per sample and per query.
+class WindowedStats
+{
+public:
+  explicit WindowedStats(double alpha = 0.2) : ewma_(alpha) {}
+
+  void push(double sample)
+  {
+    short_.push(sample);
+    long_.push(sample);
+    ewma_.add(sample);
+  }
+
+  double last() const { return short_.last(); }
+  const SlidingWindow<double, 10> &short_window() const { return short_; }
+  const SlidingWindow<double, 60> &long_window() const { return long_; }
+  double ewma() const { return ewma_.value(); }
+
+  json summary() const
+  {
+    return {{"last", last()},
+            {"mean_10", short_.mean()},
+            {"max_10", short_.max()},
+            {"mean_60", long_.mean()},
+            {"min_60", long_.min()},
+            {"max_60", long_.max()},
+            {"ewma", ewma()}};
+  }
+
+private:
+  SlidingWindow<double, 10> short_;
+  SlidingWindow<double, 60> long_;
+  Ewma ewma_;
+};
+
+#endif // STATS_H
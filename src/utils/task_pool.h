@@ -0,0 +1,365 @@
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <limits>
+#include <functional>
+#include <condition_variable>
+#include <spdlog/spdlog.h>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+enum class Priority
+{
+  HIGH,
+  NORMAL,
+  LOW,
+};
+
+constexpr size_t NUM_PRIORITIES = 3;
+
+// Work-stealing pool the engine daemons run on. Each thread owns one deque
+// per priority: it pushes and pops its own tasks at the back (the most
+// recent, still in cache), idle threads steal from the front of the others.
+// Higher priorities are always served first. Tasks must not block for long,
+// waits are expressed with submit_at()/submit_every() instead of sleeping.
+class TaskPool
+{
+public:
+  using Task = std::function<void()>;
+  using Clock = std::chrono::steady_clock;
+
+  TaskPool() {}
+
+  ~TaskPool()
+  {
+    stop();
+  }
+
+  void start(size_t num_threads)
+  {
+    num_threads = std::max<size_t>(num_threads, 1);
+    for (size_t i = 0; i < num_threads; i++)
+    {
+      workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < num_threads; i++)
+    {
+      threads_.emplace_back(&TaskPool::run, this, i);
+    }
+  }
+
+  void stop()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cond_var_.notify_all();
+    stopped_cond_.notify_all();
+    for (auto &thread : threads_)
+    {
+      if (thread.joinable())
+      {
+        thread.join();
+      }
+    }
+    threads_.clear();
+  }
+
+  // Blocks the caller until stop().
+  void join()
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopped_cond_.wait(lock, [this]()
+                       { return stopped_; });
+  }
+
+  // From a pool thread the task lands on its own deque, otherwise the
+  // threads are fed in turn.
+  void submit(Task task, Priority priority = Priority::NORMAL)
+  {
+    size_t index = current().first == this ? current().second : next_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    Worker &worker = *workers_[index];
+    {
+      std::lock_guard<std::mutex> lock(worker.mutex);
+      worker.tasks[static_cast<size_t>(priority)].push_back(std::move(task));
+    }
+    worker.size.fetch_add(1);
+    pending_.fetch_add(1);
+    if (sleeping_.load() > 0)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cond_var_.notify_one();
+    }
+  }
+
+  void submit_at(Clock::time_point when, Task task, Priority priority = Priority::NORMAL)
+  {
+    bool earliest;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      earliest = timers_.empty() || when < timers_.top().when;
+      timers_.push(Timer{when, std::move(task), priority});
+      next_timer_.store(timers_.top().when.time_since_epoch().count());
+    }
+    if (earliest)
+    {
+      cond_var_.notify_one();
+    }
+  }
+
+  void submit_after(Clock::duration delay, Task task, Priority priority = Priority::NORMAL)
+  {
+    submit_at(Clock::now() + delay, std::move(task), priority);
+  }
+
+  // Runs the task every interval, counted from the end of the previous run.
+  // A run that throws is logged and does not end the series.
+  void submit_every(Clock::duration interval, Task task, Priority priority = Priority::NORMAL)
+  {
+    submit_after(interval, [this, interval, task, priority]()
+                 {
+      try
+      {
+        task();
+      }
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️[tasks] Periodic task failed\n\t{}", e.what());
+      }
+      submit_every(interval, task, priority); }, priority);
+  }
+
+  size_t size() const { return workers_.size(); }
+
+  // Per-thread counters; busy_us over wall time is the CPU share the
+  // engine spends in its own tasks.
+  json metrics()
+  {
+    json threads = json::array();
+    for (auto &worker : workers_)
+    {
+      threads.push_back({{"executed", worker->executed.load(std::memory_order_relaxed)},
+                         {"stolen", worker->stolen.load(std::memory_order_relaxed)},
+                         {"busy_us", worker->busy_us.load(std::memory_order_relaxed)}});
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {{"pending", pending_.load()}, {"timers", timers_.size()}, {"threads", threads}};
+  }
+
+private:
+  struct alignas(64) Worker
+  {
+    std::mutex mutex;
+    std::array<std::deque<Task>, NUM_PRIORITIES> tasks;
+    std::atomic<size_t> size{0};
+    std::atomic<uint64_t> executed{0};
+    std::atomic<uint64_t> stolen{0};
+    std::atomic<uint64_t> busy_us{0};
+  };
+
+  struct Timer
+  {
+    Clock::time_point when;
+    Task task;
+    Priority priority;
+    bool operator>(const Timer &other) const { return when > other.when; }
+  };
+
+  static std::pair<const TaskPool *, size_t> &current()
+  {
+    static thread_local std::pair<const TaskPool *, size_t> worker{nullptr, 0};
+    return worker;
+  }
+
+  void run(size_t index)
+  {
+    current() = {this, index};
+    Worker &self = *workers_[index];
+    Task task;
+    while (true)
+    {
+      if (next_timer_.load(std::memory_order_relaxed) <= Clock::now().time_since_epoch().count())
+      {
+        fire_timers();
+      }
+      if (take(index, task))
+      {
+        auto start = Clock::now();
+        try
+        {
+          task();
+        }
+        catch (const std::exception &e)
+        {
+          spdlog::error("⛔️[tasks] Task failed\n\t{}", e.what());
+        }
+        task = nullptr;
+        self.executed.fetch_add(1, std::memory_order_relaxed);
+        self.busy_us.fetch_add(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count(),
+                               std::memory_order_relaxed);
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stopped_)
+      {
+        return;
+      }
+      sleeping_.fetch_add(1);
+      if (pending_.load() == 0)
+      {
+        if (timers_.empty())
+        {
+          cond_var_.wait(lock);
+        }
+        else
+        {
+          cond_var_.wait_until(lock, timers_.top().when);
+        }
+      }
+      sleeping_.fetch_sub(1);
+    }
+  }
+
+  // Own deque first, newest task first; then the oldest task of another
+  // thread, priority by priority.
+  bool take(size_t index, Task &task)
+  {
+    if (pending_.load() == 0)
+    {
+      return false;
+    }
+    for (size_t priority = 0; priority < NUM_PRIORITIES; priority++)
+    {
+      Worker &self = *workers_[index];
+      if (pop(self, priority, task, false))
+      {
+        return true;
+      }
+      for (size_t i = 1; i < workers_.size(); i++)
+      {
+        Worker &victim = *workers_[(index + i) % workers_.size()];
+        if (pop(victim, priority, task, true))
+        {
+          self.stolen.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  bool pop(Worker &worker, size_t priority, Task &task, bool front)
+  {
+    if (worker.size.load() == 0)
+    {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    auto &tasks = worker.tasks[priority];
+    if (tasks.empty())
+    {
+      return false;
+    }
+    if (front)
+    {
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    else
+    {
+      task = std::move(tasks.back());
+      tasks.pop_back();
+    }
+    worker.size.fetch_sub(1);
+    pending_.fetch_sub(1);
+    return true;
+  }
+
+  void fire_timers()
+  {
+    std::vector<Timer> due;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto now = Clock::now();
+      while (!timers_.empty() && timers_.top().when <= now)
+      {
+        due.push_back(std::move(const_cast<Timer &>(timers_.top())));
+        timers_.pop();
+      }
+      next_timer_.store(timers_.empty() ? NO_TIMER : timers_.top().when.time_since_epoch().count());
+    }
+    for (auto &timer : due)
+    {
+      submit(std::move(timer.task), timer.priority);
+    }
+  }
+
+  static constexpr Clock::rep NO_TIMER = std::numeric_limits<Clock::rep>::max();
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_{0};
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> sleeping_{0};
+  std::atomic<Clock::rep> next_timer_{NO_TIMER};
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers_;
+  std::mutex mutex_;
+  std::condition_variable cond_var_;
+  std::condition_variable stopped_cond_;
+  bool stopped_ = false;
+};
+
+// Drain-style job on a pool: trigger() runs fn at most once at a time, and
+// again if it was triggered meanwhile, so fn sees every trigger.
+class SerialTask
+{
+public:
+  SerialTask(TaskPool &pool, std::function<void()> fn, Priority priority = Priority::NORMAL)
+      : pool_(pool), fn_(fn), priority_(priority) {}
+
+  void trigger()
+  {
+    if (pending_.fetch_add(1) == 0)
+    {
+      pool_.submit([this]()
+                   { run(); }, priority_);
+    }
+  }
+
+private:
+  void run()
+  {
+    size_t seen;
+    do
+    {
+      seen = pending_.load();
+      try
+      {
+        fn_();
+      }
+      catch (const std::exception &e)
+      {
+        spdlog::error("⛔️[tasks] Serial task failed\n\t{}", e.what());
+      }
+    } while (pending_.fetch_sub(seen) != seen);
+  }
+
+  TaskPool &pool_;
+  std::function<void()> fn_;
+  Priority priority_;
+  std::atomic<size_t> pending_{0};
+};
+
+#endif // TASK_POOL_H